@@ -8,6 +8,7 @@
 #include <stdint.h> /* uintX_t etc */
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/types.h>
 #include <time.h>
 
 #include <mndiag.h>
@@ -42,6 +43,12 @@ typedef struct _mnfcgi_config mnfcgi_config_t;
 #ifndef MNFCGI_STATS_T_DEFINED
 struct _mnfcgi_stats {
     int nthreads;
+    size_t nrecords_reused;
+    size_t nrecords_allocated;
+    /* requests in flight */
+    size_t nrequests;
+    /* requests rejected with FCGI_OVERLOADED */
+    size_t noverloaded;
 };
 typedef struct _mnfcgi_stats mnfcgi_stats_t;
 #define MNFCGI_STATS_T_DEFINED
@@ -71,6 +78,38 @@ typedef enum _mnfcgi_request_method {
 #define MNFCGI_REQUEST_METHOD_T_DEFINED
 #endif
 
+#ifndef MNFCGI_CGI_VAR_T_DEFINED
+/*
+ * RFC 3875 meta-variables, and a few common extensions, that are looked
+ * up by the parser in FCGI_PARAMS.
+ */
+typedef enum _mnfcgi_cgi_var {
+    MNFCGI_CGI_AUTH_TYPE =          0,
+    MNFCGI_CGI_CONTENT_LENGTH =     1,
+    MNFCGI_CGI_CONTENT_TYPE =       2,
+    MNFCGI_CGI_GATEWAY_INTERFACE =  3,
+    MNFCGI_CGI_HTTP_COOKIE =        4,
+    MNFCGI_CGI_HTTP_HOST =          5,
+    MNFCGI_CGI_PATH_INFO =          6,
+    MNFCGI_CGI_PATH_TRANSLATED =    7,
+    MNFCGI_CGI_QUERY_STRING =       8,
+    MNFCGI_CGI_REMOTE_ADDR =        9,
+    MNFCGI_CGI_REMOTE_HOST =        10,
+    MNFCGI_CGI_REMOTE_IDENT =       11,
+    MNFCGI_CGI_REMOTE_USER =        12,
+    MNFCGI_CGI_REQUEST_METHOD =     13,
+    MNFCGI_CGI_REQUEST_SCHEME =     14,
+    MNFCGI_CGI_REQUEST_URI =        15,
+    MNFCGI_CGI_SCRIPT_NAME =        16,
+    MNFCGI_CGI_SERVER_NAME =        17,
+    MNFCGI_CGI_SERVER_PORT =        18,
+    MNFCGI_CGI_SERVER_PROTOCOL =    19,
+    MNFCGI_CGI_SERVER_SOFTWARE =    20,
+    MNFCGI_CGI_COUNT =              21,
+} mnfcgi_cgi_var_t;
+#define MNFCGI_CGI_VAR_T_DEFINED
+#endif
+
 #ifndef MNFCGI_REQUEST_T_DEFINED
 struct _mnfcgi_request {
     /*
@@ -86,8 +125,6 @@ struct _mnfcgi_request {
         mnfcgi_request_method_t method;
         mnbytes_t *script_name;
         mnbytes_t *path_info;
-        mnhash_t query_terms;
-        mnhash_t cookie;
         mnbytes_t *content_type;
         size_t content_length;
     } info;
@@ -110,7 +147,23 @@ void *mnfcgi_stderr_get_udata(mnfcgi_record_t *);
  * mnfcgi_config_t
  */
 int mnfcgi_serve(mnfcgi_config_t *);
+int mnfcgi_prefork(mnfcgi_config_t *);
+void mnfcgi_config_set_workers(mnfcgi_config_t *, int);
+void mnfcgi_config_set_worker_cpus(mnfcgi_config_t *, const int *, size_t);
+int mnfcgi_config_get_worker(mnfcgi_config_t *);
+int mnfcgi_run_pthreads(mnfcgi_config_t *);
+void mnfcgi_config_set_pthreads(mnfcgi_config_t *, int);
+void mnfcgi_config_set_reuseport(mnfcgi_config_t *, bool);
+void mnfcgi_config_set_unix_perms(mnfcgi_config_t *, mode_t, uid_t, gid_t);
 mnfcgi_stats_t *mnfcgi_config_get_stats(mnfcgi_config_t *);
+void mnfcgi_config_set_request_arena(mnfcgi_config_t *, size_t);
+void mnfcgi_config_set_record_pool(mnfcgi_config_t *, size_t);
+void mnfcgi_config_set_ctx_pool(mnfcgi_config_t *, size_t);
+void mnfcgi_config_set_stdout_watermark(mnfcgi_config_t *, size_t);
+void mnfcgi_config_set_stdin_watermark(mnfcgi_config_t *, size_t);
+void mnfcgi_config_set_stdin_spill(mnfcgi_config_t *, size_t, const char *);
+void mnfcgi_config_set_max_params(mnfcgi_config_t *, size_t);
+void mnfcgi_config_set_max_terms(mnfcgi_config_t *, size_t);
 
 /*
  * diag.txt
@@ -187,10 +240,48 @@ mnfcgi_stats_t *mnfcgi_config_get_stats(mnfcgi_config_t *);
 int mnfcgi_render_stdout(mnfcgi_request_t *,
                          mnfcgi_renderer_t,
                          void *);
+/*
+ * Send data by reference, without copying it to the connection buffer.
+ * The bytes are held until sent (a string's terminating zero is not
+ * sent), plain data must stay valid until mnfcgi_flush_out() or
+ * mnfcgi_finalize_request().
+ */
+int mnfcgi_render_stdout_bytes(mnfcgi_request_t *, mnbytes_t *);
+int mnfcgi_render_stdout_data(mnfcgi_request_t *, const void *, size_t);
+/*
+ * Send len bytes of the file fd starting at off, with sendfile() where
+ * available.  The fd must stay open until mnfcgi_flush_out() or
+ * mnfcgi_finalize_request().
+ */
+int mnfcgi_render_stdout_fd(mnfcgi_request_t *, int, off_t, size_t);
+/*
+ * Write the response body of any size.  Data is copied into FCGI_STDOUT
+ * records of up to MNFCGI_MAX_RECORD_PAYLOAD bytes, and the output is
+ * flushed once it reaches the configured watermark.
+ */
+#define MNFCGI_MAX_RECORD_PAYLOAD (0xffff)
+int mnfcgi_write(mnfcgi_request_t *, const void *, size_t);
+int PRINTFLIKE(2, 3) mnfcgi_writef(mnfcgi_request_t *, const char *, ...);
 int mnfcgi_flush_out(mnfcgi_request_t *);
 int mnfcgi_finalize_request(mnfcgi_request_t *);
+/*
+ * Read the request body as it arrives.  Copy up to sz bytes of FCGI_STDIN
+ * into buf, waiting for more if none is buffered.  Return the number of
+ * bytes copied, zero at the end of the body, or an error.  Data that has
+ * been read is not passed to stdin_parse, and the range of the record
+ * being parsed is no longer valid afterwards.
+ */
+ssize_t mnfcgi_request_read(mnfcgi_request_t *, void *, size_t);
+/*
+ * A body spilled to a file (see mnfcgi_config_set_stdin_spill()), once it
+ * has ended, as an fd or a read-only mapping, and its size.  Return -1 or
+ * NULL if the body was not spilled.  Both are owned by the request.
+ */
+int mnfcgi_request_body_fd(mnfcgi_request_t *, size_t *);
+const void *mnfcgi_request_body_map(mnfcgi_request_t *, size_t *);
 void mnfcgi_request_fill_info(mnfcgi_request_t *);
 mnbytes_t *mnfcgi_request_get_param(mnfcgi_request_t *, const mnbytes_t *);
+mnbytes_t *mnfcgi_request_get_cgi(mnfcgi_request_t *, mnfcgi_cgi_var_t);
 mnbytes_t *mnfcgi_request_get_query_term(mnfcgi_request_t *, const mnbytes_t *);
 
 
@@ -262,6 +353,10 @@ ssize_t mnfcgi_cat(mnbytestream_t *, size_t, const char *);
 /*
  * ctx
  */
+/*
+ * Each request is handled in an mnthr thread of its own, which is the
+ * one this interrupts.
+ */
 void mnfcgi_ctx_send_interrupt(mnfcgi_request_t *);
 
 
@@ -1,11 +1,30 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "mnfcgi_app_private.h"
 
 #include "diag.h"
 
 
+static mnbytes_t _allow = BYTES_INITIALIZER("Allow");
 static mnbytes_t _content_length = BYTES_INITIALIZER("Content-Length");
 static mnbytes_t _location = BYTES_INITIALIZER("Location");
+static mnbytes_t _method_not_allowed = BYTES_INITIALIZER("Method Not Allowed");
 static mnbytes_t _not_found = BYTES_INITIALIZER("Not Found");
+static mnbytes_t _ok = BYTES_INITIALIZER("OK");
+
+
+/*
+ * A registered endpoint table, along with what is derived from it once
+ */
+typedef struct _mnfcgi_app_endpoint {
+    mnfcgi_app_endpoint_table_t table;
+    /* bit i is set if method_callback[i] is */
+    unsigned methods;
+    /* the value of the Allow header field */
+    mnbytes_t *allow;
+} mnfcgi_app_endpoint_t;
 
 
 static ssize_t
@@ -87,8 +106,15 @@ mnfcgi_app_end_request(UNUSED mnfcgi_record_t *rec,
 }
 
 
-void
-mnfcgi_app_error(mnfcgi_request_t *req, int code, mnbytes_t *text)
+/*
+ * Reply with an empty body, and optionally one more header field.
+ */
+static void
+mnfcgi_app_reply(mnfcgi_request_t *req,
+                 int code,
+                 mnbytes_t *text,
+                 mnbytes_t *name,
+                 mnbytes_t *value)
 {
     int res;
 
@@ -98,12 +124,21 @@ mnfcgi_app_error(mnfcgi_request_t *req, int code, mnbytes_t *text)
         goto err;
     }
 
+    if (name != NULL) {
+        if (MNUNLIKELY(
+            (res = mnfcgi_request_field_addb(req, 0, name, value)) != 0)) {
+            goto err;
+        }
+    }
+
     if (MNUNLIKELY((res = mnfcgi_request_status_set(req, code, text)) != 0)) {
         goto err;
     }
+
     if (MNUNLIKELY((res = mnfcgi_request_headers_end(req)) != 0)) {
         goto err;
     }
+
     if (MNUNLIKELY((res = mnfcgi_finalize_request(req)) != 0)) {
         goto err;
     }
@@ -122,48 +157,44 @@ err:
 }
 
 
+void
+mnfcgi_app_error(mnfcgi_request_t *req, int code, mnbytes_t *text)
+{
+    mnfcgi_app_reply(req, code, text, NULL, NULL);
+}
+
+
 void
 mnfcgi_app_redir(mnfcgi_request_t *req,
                  int code,
                  mnbytes_t *text,
                  mnbytes_t *uri)
 {
-    int res;
-
-    if (MNUNLIKELY(
-        (res = mnfcgi_request_field_addf(
-            req, 0, &_content_length, "0")) != 0)) {
-        goto err;
-    }
-
-    if (MNUNLIKELY(
-        (res = mnfcgi_request_field_addb(req, 0, &_location, uri)) != 0)) {
-        goto err;
-    }
-
-    if (MNUNLIKELY((res = mnfcgi_request_status_set(req, code, text)) != 0)) {
-        goto err;
-    }
+    mnfcgi_app_reply(req, code, text, &_location, uri);
+}
 
-    if (MNUNLIKELY((res = mnfcgi_request_headers_end(req)) != 0)) {
-        goto err;
-    }
 
-    if (MNUNLIKELY((res = mnfcgi_finalize_request(req)) != 0)) {
-        goto err;
-    }
+/*
+ * Pass the request on to the callback of its method, or answer OPTIONS
+ * and methods without a callback right away, with the precomputed Allow
+ * header field.
+ */
+static void
+mnfcgi_app_select(mnfcgi_request_t *req, mnfcgi_app_endpoint_t *e)
+{
+    if (e == NULL) {
+        /* 404 */
+        mnfcgi_app_error(req, 404, &_not_found);
 
-end:
-    return;
+    } else if (e->methods & (1u << req->info.method)) {
+        req->udata = e->table.method_callback[req->info.method];
 
-err:
-    if (res == (int)MNFCGI_REQUEST_STATE) {
-        CTRACE("MNFCGI_REQUEST_STATE violation");
+    } else if (req->info.method == MNFCGI_REQUEST_METHOD_OPTIONS) {
+        mnfcgi_app_reply(req, 200, &_ok, &_allow, e->allow);
 
     } else {
-        CTRACE("res=%s", MNFCHI_ESTR(res));
+        mnfcgi_app_reply(req, 405, &_method_not_allowed, &_allow, e->allow);
     }
-    goto end;
 }
 
 
@@ -184,16 +215,8 @@ mnfcgi_app_params_complete_select_exact(mnfcgi_request_t *req,
             BDATASAFE(req->info.script_name),
             BDATASAFE(req->info.path_info));
 
-    if ((hit = hash_get_item(&app->endpoint_tables, key)) == NULL) {
-        /* 404 */
-        mnfcgi_app_error(req, 404, &_not_found);
-    } else {
-        mnfcgi_app_endpoint_table_t *t;
-
-        t = hit->value;
-        assert(t != NULL);
-        req->udata = t->method_callback[req->info.method];
-    }
+    hit = hash_get_item(&app->endpoint_tables, key);
+    mnfcgi_app_select(req, hit != NULL ? hit->value : NULL);
 
     //CTRACE("params ...");
     return 0;
@@ -212,19 +235,9 @@ mnfcgi_app_params_complete_select_exact_script_name(
     app = (mnfcgi_app_t *)req->ctx->config;
     assert(app != NULL);
 
-    if (req->info.script_name == NULL ||
-        (hit = hash_get_item(&app->endpoint_tables,
-                             req->info.script_name)) == NULL) {
-        /* 404 */
-        mnfcgi_app_error(req, 404, &_not_found);
-
-    } else {
-        mnfcgi_app_endpoint_table_t *t;
-
-        t = hit->value;
-        assert(t != NULL);
-        req->udata = t->method_callback[req->info.method];
-    }
+    hit = req->info.script_name != NULL ?
+        hash_get_item(&app->endpoint_tables, req->info.script_name) : NULL;
+    mnfcgi_app_select(req, hit != NULL ? hit->value : NULL);
 
     //CTRACE("params ...");
     return 0;
@@ -243,25 +256,456 @@ mnfcgi_app_params_complete_select_exact_path_info(
     app = (mnfcgi_app_t *)req->ctx->config;
     assert(app != NULL);
 
-    if (req->info.path_info == NULL ||
-        (hit = hash_get_item(&app->endpoint_tables,
-                             req->info.path_info)) == NULL) {
-        /* 404 */
-        mnfcgi_app_error(req, 404, &_not_found);
+    hit = req->info.path_info != NULL ?
+        hash_get_item(&app->endpoint_tables, req->info.path_info) : NULL;
+    mnfcgi_app_select(req, hit != NULL ? hit->value : NULL);
 
-    } else {
-        mnfcgi_app_endpoint_table_t *t;
+    //CTRACE("params ...");
+    return 0;
+}
+
+/*
+ * Router
+ */
+
+/*
+ * script_name followed by path_info, matched without concatenating them
+ */
+typedef struct _mnfcgi_app_path {
+    const char *s0;
+    const char *s1;
+    size_t sz0;
+    size_t sz;
+} mnfcgi_app_path_t;
+
+#define MNFCGI_APP_PATH_AT(path, i)    \
+    ((i) < (path)->sz0 ? (path)->s0[(i)] : (path)->s1[(i) - (path)->sz0])
+
+
+static size_t
+mnfcgi_app_bytes_len(mnbytes_t *b)
+{
+    size_t sz;
 
-        t = hit->value;
-        assert(t != NULL);
-        req->udata = t->method_callback[req->info.method];
+    if (b == NULL) {
+        return 0;
+    }
+    sz = BSZ(b);
+    if (sz > 0 && BDATA(b)[sz - 1] == '\0') {
+        --sz;
     }
+    return sz;
+}
 
-    //CTRACE("params ...");
+
+static void
+mnfcgi_app_path_init(mnfcgi_app_path_t *path, mnfcgi_request_t *req)
+{
+    path->s0 = BDATASAFE(req->info.script_name);
+    path->sz0 = mnfcgi_app_bytes_len(req->info.script_name);
+    path->s1 = BDATASAFE(req->info.path_info);
+    path->sz = path->sz0 + mnfcgi_app_bytes_len(req->info.path_info);
+}
+
+
+static bool
+mnfcgi_app_path_match(const mnfcgi_app_path_t *path,
+                      size_t pos,
+                      const char *s,
+                      size_t sz)
+{
+    size_t i;
+
+    if (path->sz - pos < sz) {
+        return false;
+    }
+    for (i = 0; i < sz; ++i) {
+        if (MNFCGI_APP_PATH_AT(path, pos + i) != s[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static char *
+mnfcgi_app_strndup(const char *s, size_t sz)
+{
+    char *res;
+
+    if (MNUNLIKELY((res = malloc(sz + 1)) == NULL)) {
+        FAIL("malloc");
+    }
+    memcpy(res, s, sz);
+    res[sz] = '\0';
+    return res;
+}
+
+
+static mnfcgi_app_route_t *
+mnfcgi_app_route_new(const char *prefix, size_t sz)
+{
+    mnfcgi_app_route_t *route;
+
+    if (MNUNLIKELY((route = malloc(sizeof(mnfcgi_app_route_t))) == NULL)) {
+        FAIL("malloc");
+    }
+    route->prefix = mnfcgi_app_strndup(prefix != NULL ? prefix : "", sz);
+    route->prefixsz = sz;
+    route->children = NULL;
+    route->nchildren = 0;
+    route->param = NULL;
+    route->param_name = NULL;
+    route->wildcard = NULL;
+    route->wildcard_name = NULL;
+    route->endpoint = NULL;
+    return route;
+}
+
+
+static void
+mnfcgi_app_route_destroy(mnfcgi_app_route_t **route)
+{
+    if (*route != NULL) {
+        size_t i;
+
+        for (i = 0; i < (*route)->nchildren; ++i) {
+            mnfcgi_app_route_destroy(&(*route)->children[i]);
+        }
+        free((*route)->children);
+        mnfcgi_app_route_destroy(&(*route)->param);
+        free((*route)->param_name);
+        free((*route)->wildcard_name);
+        free((*route)->prefix);
+        free(*route);
+        *route = NULL;
+    }
+}
+
+
+static mnfcgi_app_route_t *
+mnfcgi_app_route_add_child(mnfcgi_app_route_t *route,
+                           const char *prefix,
+                           size_t sz)
+{
+    mnfcgi_app_route_t *child;
+
+    child = mnfcgi_app_route_new(prefix, sz);
+    if (MNUNLIKELY((route->children = realloc(
+                    route->children,
+                    sizeof(mnfcgi_app_route_t *) *
+                        (route->nchildren + 1))) == NULL)) {
+        FAIL("realloc");
+    }
+    route->children[route->nchildren++] = child;
+    return child;
+}
+
+
+static int
+mnfcgi_app_route_set_wildcard(mnfcgi_app_route_t *route,
+                              const char *name,
+                              size_t sz,
+                              mnfcgi_app_endpoint_t *e)
+{
+    if (route->wildcard != NULL) {
+        return -1;
+    }
+    route->wildcard = e;
+    route->wildcard_name = sz > 0 ? mnfcgi_app_strndup(name, sz) : NULL;
     return 0;
 }
 
 
+static int
+mnfcgi_app_route_insert(mnfcgi_app_route_t *route,
+                        const char *p,
+                        size_t sz,
+                        mnfcgi_app_endpoint_t *e,
+                        unsigned nparams)
+{
+    mnfcgi_app_route_t *child;
+    size_t i, n, l;
+
+    if (sz == 0) {
+        if (route->endpoint != NULL) {
+            return -1;
+        }
+        route->endpoint = e;
+        return 0;
+    }
+
+    if (*p == '{') {
+        const char *end;
+        size_t namesz;
+
+        if ((end = memchr(p, '}', sz)) == NULL ||
+            (namesz = end - p - 1) == 0 ||
+            ++nparams > MNFCGI_ROUTE_MAX_PARAMS) {
+            return -1;
+        }
+        if (p[namesz] == '*') {
+            /* {name*} has to come last */
+            if ((size_t)(end - p) + 1 != sz) {
+                return -1;
+            }
+            return mnfcgi_app_route_set_wildcard(route, p + 1, namesz - 1, e);
+        }
+        if (route->param == NULL) {
+            route->param = mnfcgi_app_route_new(NULL, 0);
+            route->param_name = mnfcgi_app_strndup(p + 1, namesz);
+        } else if (strlen(route->param_name) != namesz ||
+                   memcmp(route->param_name, p + 1, namesz) != 0) {
+            /* {a} and {b} in the same place */
+            return -1;
+        }
+        return mnfcgi_app_route_insert(route->param,
+                                       end + 1,
+                                       sz - (end - p) - 1,
+                                       e,
+                                       nparams);
+    }
+
+    if (*p == '*' && sz == 1) {
+        return mnfcgi_app_route_set_wildcard(route, NULL, 0, e);
+    }
+
+    /* static run, up to the next parameter */
+    for (n = 0;
+         n < sz && p[n] != '{' && !(p[n] == '*' && n == sz - 1);
+         ++n) {
+    }
+
+    for (i = 0; i < route->nchildren; ++i) {
+        if (route->children[i]->prefix[0] == *p) {
+            break;
+        }
+    }
+    if (i == route->nchildren) {
+        child = mnfcgi_app_route_add_child(route, p, n);
+        return mnfcgi_app_route_insert(child, p + n, sz - n, e, nparams);
+    }
+
+    child = route->children[i];
+    for (l = 0;
+         l < n && l < child->prefixsz && child->prefix[l] == p[l];
+         ++l) {
+    }
+    if (l < child->prefixsz) {
+        mnfcgi_app_route_t *mid;
+
+        /* split the edge */
+        mid = mnfcgi_app_route_new(child->prefix, l);
+        memmove(child->prefix, child->prefix + l, child->prefixsz - l + 1);
+        child->prefixsz -= l;
+        if (MNUNLIKELY((mid->children = malloc(
+                        sizeof(mnfcgi_app_route_t *))) == NULL)) {
+            FAIL("malloc");
+        }
+        mid->children[0] = child;
+        mid->nchildren = 1;
+        route->children[i] = mid;
+        child = mid;
+    }
+    return mnfcgi_app_route_insert(child, p + l, sz - l, e, nparams);
+}
+
+
+static mnfcgi_app_endpoint_t *
+mnfcgi_app_route_match(mnfcgi_app_route_t *route,
+                       const mnfcgi_app_path_t *path,
+                       size_t pos,
+                       mnfcgi_route_param_t *params,
+                       size_t *nparams)
+{
+    mnfcgi_app_endpoint_t *res;
+
+    if (pos == path->sz && route->endpoint != NULL) {
+        return route->endpoint;
+    }
+
+    if (pos < path->sz) {
+        char c;
+        size_t i;
+
+        c = MNFCGI_APP_PATH_AT(path, pos);
+        for (i = 0; i < route->nchildren; ++i) {
+            mnfcgi_app_route_t *child;
+
+            child = route->children[i];
+            if (child->prefix[0] == c) {
+                if (mnfcgi_app_path_match(path,
+                                          pos,
+                                          child->prefix,
+                                          child->prefixsz) &&
+                    (res = mnfcgi_app_route_match(child,
+                                                  path,
+                                                  pos + child->prefixsz,
+                                                  params,
+                                                  nparams)) != NULL) {
+                    return res;
+                }
+                break;
+            }
+        }
+
+        if (route->param != NULL) {
+            size_t end;
+
+            for (end = pos;
+                 end < path->sz && MNFCGI_APP_PATH_AT(path, end) != '/';
+                 ++end) {
+            }
+            if (end > pos) {
+                params[*nparams].name = route->param_name;
+                params[*nparams].start = pos;
+                params[*nparams].sz = end - pos;
+                ++(*nparams);
+                if ((res = mnfcgi_app_route_match(route->param,
+                                                  path,
+                                                  end,
+                                                  params,
+                                                  nparams)) != NULL) {
+                    return res;
+                }
+                --(*nparams);
+            }
+        }
+    }
+
+    if (route->wildcard != NULL) {
+        if (route->wildcard_name != NULL) {
+            params[*nparams].name = route->wildcard_name;
+            params[*nparams].start = pos;
+            params[*nparams].sz = path->sz - pos;
+            ++(*nparams);
+        }
+        return route->wildcard;
+    }
+
+    return NULL;
+}
+
+
+#ifdef UNITTEST
+mnfcgi_app_endpoint_table_t *
+_mnfcgi_app_route_find(mnfcgi_app_t *app, const char *s, size_t sz)
+{
+    mnfcgi_app_path_t path;
+    mnfcgi_route_param_t params[MNFCGI_ROUTE_MAX_PARAMS];
+    size_t nparams;
+    mnfcgi_app_endpoint_t *e;
+
+    path.s0 = s;
+    path.sz0 = sz;
+    path.s1 = NULL;
+    path.sz = sz;
+    nparams = 0;
+    e = mnfcgi_app_route_match(app->routes, &path, 0, params, &nparams);
+    return e != NULL ? &e->table : NULL;
+}
+#endif
+
+
+/*
+ * Match script_name followed by path_info, and keep the params in req.
+ */
+static mnfcgi_app_endpoint_t *
+mnfcgi_app_route_request(mnfcgi_app_t *app, mnfcgi_request_t *req)
+{
+    mnfcgi_app_path_t path;
+
+    mnfcgi_app_path_init(&path, req);
+    req->nroute_params = 0;
+    req->route_buf = NULL;
+    return mnfcgi_app_route_match(app->routes,
+                                  &path,
+                                  0,
+                                  req->route_params,
+                                  &req->nroute_params);
+}
+
+
+#ifdef UNITTEST
+mnfcgi_app_endpoint_table_t *
+_mnfcgi_app_route_request(mnfcgi_app_t *app, mnfcgi_request_t *req)
+{
+    mnfcgi_app_endpoint_t *e;
+
+    e = mnfcgi_app_route_request(app, req);
+    return e != NULL ? &e->table : NULL;
+}
+#endif
+
+
+/*
+ * Select the endpoint by script_name followed by path_info, matched
+ * against the registered patterns.
+ */
+int
+mnfcgi_app_params_complete_select_route(mnfcgi_request_t *req,
+                                        UNUSED void *udata)
+{
+    mnfcgi_app_t *app;
+
+    mnfcgi_request_fill_info(req);
+
+    app = (mnfcgi_app_t *)req->ctx->config;
+    assert(app != NULL);
+
+    mnfcgi_app_select(req, mnfcgi_app_route_request(app, req));
+    return 0;
+}
+
+
+const char *
+mnfcgi_app_get_route_param(mnfcgi_request_t *req,
+                           const char *name,
+                           size_t *sz)
+{
+    size_t i;
+
+    for (i = 0; i < req->nroute_params; ++i) {
+        mnfcgi_route_param_t *p;
+
+        p = &req->route_params[i];
+        if (strcmp(p->name, name) == 0) {
+            mnfcgi_app_path_t path;
+            char *s;
+
+            mnfcgi_app_path_init(&path, req);
+            if (sz != NULL) {
+                *sz = p->sz;
+            }
+            if (p->start + p->sz <= path.sz0) {
+                return path.s0 + p->start;
+            } else if (p->start >= path.sz0) {
+                return path.s1 + (p->start - path.sz0);
+            }
+
+            /* spans script_name and path_info, there is one such at most */
+            if (req->route_buf != NULL) {
+                return req->route_buf;
+            }
+            if (req->arena.chunksz > 0) {
+                s = mnfcgi_arena_alloc(&req->arena, p->sz);
+            } else {
+                if (MNUNLIKELY((s = malloc(p->sz)) == NULL)) {
+                    FAIL("malloc");
+                }
+            }
+            memcpy(s, path.s0 + p->start, path.sz0 - p->start);
+            memcpy(s + (path.sz0 - p->start),
+                   path.s1,
+                   p->sz - (path.sz0 - p->start));
+            req->route_buf = s;
+            return s;
+        }
+    }
+    return NULL;
+}
+
+
 #if 0
 int
 myoauth_app_params_odata(mnfcgi_request_t *req, UNUSED void *udata)
@@ -298,7 +742,8 @@ myoauth_app_params_odata(mnfcgi_request_t *req, UNUSED void *udata)
 
 
 /*
- * return either NULL, or an (mnbytes_t *) instance with nref = 0;
+ * Return either NULL, or the value of the Allow header field of the
+ * endpoint, which is owned by the app.
  */
 
 #ifndef UNITTEST
@@ -307,57 +752,74 @@ static
 mnbytes_t *
 _mnfcgi_app_get_allowed_methods(mnfcgi_app_t *app, mnbytes_t *script_name)
 {
-    mnbytes_t *res;
     mnhash_item_t *hit;
-    res = NULL;
+
     if ((hit = hash_get_item(&app->endpoint_tables, script_name)) != NULL) {
-        mnfcgi_app_endpoint_table_t *t;
-        unsigned i;
-        size_t sz;
-        BYTES_ALLOCA(comma, ",");
-
-        t = hit->value;
-        assert(t != NULL);
-
-        /*
-         * XXX we rely on the fact that none of mnfcgi_request_methods[]
-         * XXX items is longer than 16 chars.
-         */
-        res = bytes_new(countof(t->method_callback) * 16);
-        memset(BDATA(res), '\0', countof(t->method_callback) * 16);
-        sz = 0;
-        for (i = 0; i < countof(t->method_callback); ++i) {
-            if (t->method_callback[i] != NULL) {
-                mnbytes_t *m;
-
-                m = mnfcgi_request_method_str(i);
-                bytes_copy(res, m, sz);
-                sz += BSZ(m) - 1;
-                bytes_copy(res, comma, sz);
-                sz += BSZ(comma) - 1;
-            }
-        }
-        if (sz > 0) {
-            sz -= BSZ(comma) - 1;
-        }
-        BDATA(res)[sz] = '\0';
-        ++sz;
-        BSZ(res) = sz;
+        mnfcgi_app_endpoint_t *e;
+
+        e = hit->value;
+        assert(e != NULL);
+        return e->allow;
     }
+    return NULL;
+}
 
-    return res;
+
+/*
+ * Build the Allow header field value once, when the endpoint is
+ * registered.
+ */
+static void
+mnfcgi_app_endpoint_init(mnfcgi_app_endpoint_t *e,
+                         mnfcgi_app_endpoint_table_t *table)
+{
+    /*
+     * XXX we rely on the fact that none of mnfcgi_request_methods[]
+     * XXX items is longer than 16 chars.
+     */
+    char buf[countof(table->method_callback) * 16];
+    size_t sz;
+    unsigned i;
+
+    e->table = *table;
+    e->methods = 0;
+    sz = 0;
+    buf[0] = '\0';
+    for (i = 0; i < countof(table->method_callback); ++i) {
+        if (table->method_callback[i] != NULL) {
+            mnbytes_t *m;
+
+            e->methods |= 1u << i;
+            m = mnfcgi_request_method_str(i);
+            sz += snprintf(buf + sz,
+                           sizeof(buf) - sz,
+                           "%s%s",
+                           sz > 0 ? "," : "",
+                           BCDATA(m));
+        }
+    }
+    e->allow = bytes_new_from_str(buf);
+    BYTES_INCREF(e->allow);
 }
 
 
+/*
+ * The caller gets a reference of its own, and drops it with BYTES_DECREF().
+ */
 mnbytes_t *
 mnfcgi_app_get_allowed_methods(mnfcgi_request_t *req)
 {
     mnfcgi_app_t *app;
+    mnbytes_t *res;
 
     app = (mnfcgi_app_t *)req->ctx->config;
     assert(app != NULL);
     assert(req->info.script_name != NULL);
-    return _mnfcgi_app_get_allowed_methods(app, req->info.script_name);
+    if ((res = _mnfcgi_app_get_allowed_methods(
+                    app, req->info.script_name)) != NULL) {
+        BYTES_INCREF(res);
+    }
+    return res;
 }
 
 
@@ -384,7 +846,11 @@ mnfcgi_app_endpoint_table_item_fini(void *k, void *v)
 
     BYTES_DECREF(&key);
     if (MNLIKELY(value != NULL)) {
-        free(value);
+        mnfcgi_app_endpoint_t *e;
+
+        e = value;
+        BYTES_DECREF(&e->allow);
+        free(e);
         value = NULL;
     }
     return 0;
@@ -419,6 +885,7 @@ mnfcgi_app_init(mnfcgi_app_t *app,
               _bytes_hash,
               _bytes_cmp,
               mnfcgi_app_endpoint_table_item_fini);
+    app->routes = mnfcgi_app_route_new(NULL, 0);
 
     if (app->callback_table.init_app != NULL) {
         res = app->callback_table.init_app(app);
@@ -430,7 +897,7 @@ mnfcgi_app_init(mnfcgi_app_t *app,
 void
 mnfcgi_app_incref(mnfcgi_app_t *app)
 {
-    ++app->config.nref;
+    MNFCGI_CONFIG_INCREF(&app->config);
 }
 
 
@@ -445,14 +912,24 @@ mnfcgi_app_register_endpoint(mnfcgi_app_t *app,
             hash_get_item(&app->endpoint_tables, table->endpoint) != NULL)) {
         res = -1;
     } else {
-        mnfcgi_app_endpoint_table_t *t;
+        mnfcgi_app_endpoint_t *e;
 
         if (MNUNLIKELY(
-                (t = malloc(sizeof(mnfcgi_app_endpoint_table_t))) == NULL)) {
+                (e = malloc(sizeof(mnfcgi_app_endpoint_t))) == NULL)) {
             FAIL("malloc");
         }
-        *t = *table;
-        hash_set_item(&app->endpoint_tables, t->endpoint, t);
+        mnfcgi_app_endpoint_init(e, table);
+        if (mnfcgi_app_route_insert(app->routes,
+                                    BCDATA(e->table.endpoint),
+                                    mnfcgi_app_bytes_len(e->table.endpoint),
+                                    e,
+                                    0) != 0) {
+            /* malformed or conflicting pattern */
+            BYTES_DECREF(&e->allow);
+            free(e);
+            return -1;
+        }
+        hash_set_item(&app->endpoint_tables, e->table.endpoint, e);
         BYTES_INCREF(table->endpoint);
     }
     return res;
@@ -464,6 +941,7 @@ mnfcgi_app_fini(mnfcgi_app_t *app)
     if (app->callback_table.fini_app != NULL) {
         (void)app->callback_table.fini_app(app);
     }
+    mnfcgi_app_route_destroy(&app->routes);
     hash_fini(&app->endpoint_tables);
     mnfcgi_config_fini(&app->config);
 }
@@ -498,7 +976,7 @@ void
 mnfcgi_app_destroy(mnfcgi_app_t **app)
 {
     if (*app != NULL) {
-        if (--(*app)->config.nref <= 0) {
+        if (MNFCGI_ATOMIC_SUB(&(*app)->config.nref, 1) <= 0) {
             mnfcgi_app_fini(*app);
             free(*app);
         }
@@ -54,6 +54,11 @@ typedef struct _mnfcgi_app_callback_table {
 /*
  * Defines an API endpoint, and can be accessed as
  * (mnfcgi_app_callback_table_t *)mnfcgi_request_t::udata
+ *
+ * For mnfcgi_app_params_complete_select_route(), the endpoint is a
+ * pattern: a {name} segment captures one path segment, and a trailing
+ * {name*} or * captures the rest of the path.  Static segments win over
+ * parameters, and parameters over wildcards.
  */
 typedef struct _mnfcgi_app_endpoint_table {
     mnbytes_t *endpoint;
@@ -80,6 +85,20 @@ void mnfcgi_app_set_udata(mnfcgi_app_t *, void *);
 int mnfcgi_app_params_complete_select_exact(mnfcgi_request_t *, void *);
 int mnfcgi_app_params_complete_select_exact_script_name(mnfcgi_request_t *, void *);
 int mnfcgi_app_params_complete_select_exact_path_info(mnfcgi_request_t *, void *);
+int mnfcgi_app_params_complete_select_route(mnfcgi_request_t *, void *);
+/*
+ * The value of a path parameter of the matched route, not nul-terminated,
+ * or NULL.
+ */
+const char *mnfcgi_app_get_route_param(mnfcgi_request_t *,
+                                       const char *,
+                                       size_t *);
+/*
+ * The value of the Allow header field for the endpoint of script_name,
+ * precomputed at registration, or NULL.  A new reference is returned,
+ * release it with BYTES_DECREF().  The selectors answer OPTIONS and
+ * methods with no callback (405) with it on their own.
+ */
 mnbytes_t *mnfcgi_app_get_allowed_methods(mnfcgi_request_t *);
 
 void mnfcgi_app_error(mnfcgi_request_t *, int, mnbytes_t *);
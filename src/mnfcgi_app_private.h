@@ -36,6 +36,25 @@ typedef struct _mnfcgi_app_callback_table {
 #define MNFCGI_APP_CALLBACK_TABLE_T_DEFINED
 
 
+/*
+ * A node of the compressed radix tree of endpoints.  Static children are
+ * told apart by the first character of their prefix.
+ */
+typedef struct _mnfcgi_app_route {
+    char *prefix;
+    size_t prefixsz;
+    struct _mnfcgi_app_route **children;
+    size_t nchildren;
+    /* {name}, matches a non-empty path segment */
+    struct _mnfcgi_app_route *param;
+    char *param_name;
+    /* {name*} or a trailing *, matches the rest of the path */
+    struct _mnfcgi_app_endpoint *wildcard;
+    char *wildcard_name;
+    struct _mnfcgi_app_endpoint *endpoint;
+} mnfcgi_app_route_t;
+
+
 typedef struct _mnfcgi_app {
     /*
      * private
@@ -43,6 +62,7 @@ typedef struct _mnfcgi_app {
     mnfcgi_config_t config;
     mnfcgi_app_callback_table_t callback_table;
     mnhash_t endpoint_tables;
+    mnfcgi_app_route_t *routes;
 } mnfcgi_app_t;
 #define MNFCGI_APP_T_DEFINED
 
@@ -9,6 +9,8 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
 
 #include <mncommon/bytes.h>
 #include <mncommon/bytestream.h>
@@ -34,10 +36,13 @@ extern "C" {
  * wire
  */
 union _mnfcgi_record;
+struct _mnfcgi_record_pool;
 
 #define MNFCGI_HEADER_LEN           8
 typedef struct _mnfcgi_header {
     STQUEUE_ENTRY(_mnfcgi_header, link);
+    /* weak, where to return the record to on destroy */
+    struct _mnfcgi_record_pool *pool;
 #define MNFCGI_VERSION              1
     uint8_t version;
 #define MNFCGI_BEGIN_REQUEST        1
@@ -148,13 +153,70 @@ typedef struct _mnfcgi_end_request {
 
 /*
  * MNFCGI_PARAMS (in) stream
+ *
+ * Name-value pairs are kept as byte ranges into the stream the record was
+ * parsed from.  An mnbytes_t is made for a value only when it is looked up,
+ * and is then cached in bvalue until the record is destroyed.
  */
+typedef struct _mnfcgi_param {
+    byterange_t name;
+    byterange_t value;
+    mnbytes_t *bvalue;
+    /* mnfcgi_cgi_var_t, or -1 */
+    int cgi;
+} mnfcgi_param_t;
+
 typedef struct _mnfcgi_params {
     mnfcgi_header_t header;
-    mnhash_t params;
+    mnbytestream_t *bs;
+    mnfcgi_param_t *params;
+    size_t nparams;
+    size_t szparams;
 } mnfcgi_params_t;
 
 
+/*
+ * All request parameters, merged from the FCGI_PARAMS records when the
+ * stream is complete.  Names and values are copied into a single buffer
+ * that also holds the parameter array and an open addressing index of
+ * power of two size.
+ */
+typedef struct _mnfcgi_param_slot {
+    uint32_t hash;
+    /* index into params + 1, zero is an empty slot */
+    uint32_t idx;
+} mnfcgi_param_slot_t;
+
+typedef struct _mnfcgi_param_table {
+    void *buf;
+    mnfcgi_param_t *params;
+    size_t nparams;
+    mnfcgi_param_slot_t *slots;
+    size_t nslots;
+    char *data;
+} mnfcgi_param_table_t;
+
+
+/*
+ * Query terms and cookies, as ranges of the QUERY_STRING and HTTP_COOKIE
+ * values in the parameter table data.  A value is percent-decoded into the
+ * request arena when it is first asked for.
+ */
+typedef struct _mnfcgi_kv {
+    size_t key;
+    size_t keysz;
+    size_t value;
+    size_t valuesz;
+    /* decoded value, or NULL */
+    mnbytes_t *bvalue;
+} mnfcgi_kv_t;
+
+typedef struct _mnfcgi_kv_table {
+    mnfcgi_kv_t *kvs;
+    size_t nkvs;
+} mnfcgi_kv_table_t;
+
+
 /*
  * MNFCGI_STDIN (in) stream
  */
@@ -234,6 +296,22 @@ typedef union _mnfcgi_record {
 } mnfcgi_record_t;
 #define MNFCGI_RECORD_T_DEFINED
 
+/*
+ * Per-connection freelists of records by record type.  Records keep what
+ * they have allocated (parameter arrays, hashes) while on a freelist.
+ */
+#define MNFCGI_RECORD_POOL_IDX(ty)                     \
+    ((ty) == MNFCGI_GET_VALUES_RESULT ? MNFCGI_GET_VALUES : (ty))  \
+
+typedef struct _mnfcgi_record_pool {
+    STQUEUE(_mnfcgi_header, free[MNFCGI_MAXTYPE + 1]);
+    size_t nfree[MNFCGI_MAXTYPE + 1];
+    size_t cap;
+    size_t nhits;
+    size_t nmisses;
+} mnfcgi_record_pool_t;
+
+
 /*
  * Roles
  */
@@ -250,21 +328,77 @@ typedef struct _mnfcgi_responder {
 #define MNFCGI_DATA_LENGTH      "FCGI_DATA_LENGTH"
 
 
+/*
+ * Per-request bump allocator.  Everything allocated from it is released at
+ * once when the request is finished.  A zero chunk size disables it, and
+ * the allocations fall back to malloc().
+ */
+typedef struct _mnfcgi_arena_chunk {
+    struct _mnfcgi_arena_chunk *next;
+    size_t sz;
+    size_t pos;
+    char data[];
+} mnfcgi_arena_chunk_t;
+
+typedef struct _mnfcgi_arena {
+    mnfcgi_arena_chunk_t *chunks;
+    size_t chunksz;
+} mnfcgi_arena_t;
+
+
 /*
  * Context
  */
 
 typedef struct _mnfcgi_stats {
     int nthreads;
+    size_t nrecords_reused;
+    size_t nrecords_allocated;
+    /* requests in flight */
+    size_t nrequests;
+    /* requests rejected with FCGI_OVERLOADED */
+    size_t noverloaded;
 } mnfcgi_stats_t;
 #define MNFCGI_STATS_T_DEFINED
 typedef struct _mnfcgi_config {
     int64_t nref;
+    /*
+     * host is either a host name or address, or unix:/path, or
+     * unix:@name in the abstract namespace, then port is not used
+     */
     mnbytes_t *host;
     mnbytes_t *port;
+    /* PF_INET or PF_LOCAL */
+    int family;
+    /* applied to a unix:/path socket, -1 to leave as is */
+    mode_t unix_mode;
+    uid_t unix_uid;
+    gid_t unix_gid;
     int max_conn;
     int max_req;
     int fd; /* accept socket */
+    size_t request_arena_sz;
+    size_t record_pool_cap;
+    /* closed connection contexts kept per OS thread */
+    size_t ctx_pool_cap;
+    size_t stdout_watermark;
+    size_t stdin_watermark;
+    /* bodies longer than this are spilled to a file, zero never */
+    size_t stdin_spill;
+    /* directory of spill files, NULL for memfd where available */
+    mnbytes_t *stdin_spill_dir;
+    /* params, query terms or cookies beyond these are dropped, zero never */
+    size_t max_params;
+    size_t max_terms;
+    /* prefork workers, see mnfcgi_prefork() */
+    int nworkers;
+    /* index of this worker process, or -1 */
+    int worker;
+    int *cpus;
+    size_t ncpus;
+    /* OS threads, each running an mnthr loop, see mnfcgi_run_pthreads() */
+    int npthreads;
+    bool reuseport;
     /**/
     mnfcgi_parser_t begin_request_parse;
     mnfcgi_parser_t params_parse;
@@ -278,18 +412,40 @@ typedef struct _mnfcgi_config {
 } mnfcgi_config_t;
 #define MNFCGI_CONFIG_T_DEFINED
 
-#define MNFCGI_CONFIG_INCREF(config) (++(config)->nref)
+#define MNFCGI_UNIX_PREFIX "unix:"
+
+/*
+ * The config may be shared by several OS threads.
+ */
+#define MNFCGI_ATOMIC_ADD(p, v) __atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define MNFCGI_ATOMIC_SUB(p, v) __atomic_sub_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define MNFCGI_ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+
+#define MNFCGI_CONFIG_INCREF(config) MNFCGI_ATOMIC_ADD(&(config)->nref, 1)
+
+#define MNFCGI_CONFIG_DECREF(pconfig)                          \
+do {                                                           \
+    if (*(pconfig) != NULL) {                                  \
+        if (MNFCGI_ATOMIC_SUB(&(*(pconfig))->nref, 1) <= 0) {  \
+            mnfcgi_config_fini(*(pconfig));                    \
+            free(*(pconfig));                                  \
+        }                                                      \
+        *(pconfig) = NULL;                                     \
+    }                                                          \
+} while (0)                                                    \
 
-#define MNFCGI_CONFIG_DECREF(pconfig)          \
-do {                                           \
-    if (*(pconfig) != NULL) {                  \
-        if (--((*(pconfig))->nref) <= 0) {     \
-            mnfcgi_config_fini(*(pconfig));    \
-            free(*(pconfig));                  \
-        }                                      \
-        *(pconfig) = NULL;                     \
-    }                                          \
-} while (0)                                    \
+/*
+ * A span of the pending output: either a region of ctx->out at off (ref
+ * and data are NULL), caller-owned data, optionally held by ref, or a
+ * region of the file fd at off.
+ */
+typedef struct _mnfcgi_iov {
+    mnbytes_t *ref;
+    const char *data;
+    int fd;
+    off_t off;
+    size_t sz;
+} mnfcgi_iov_t;
 
 /*
  * lifetime limited to the execution scope of
@@ -302,8 +458,40 @@ typedef struct _mnfcgi_ctx {
     void *fp;
     mnbytestream_t in;
     mnbytestream_t out;
+    mnfcgi_record_pool_t pool;
+    /* queued records that refer to in */
+    size_t npinned;
+    /* scatter-gather output, empty when out is sent as is */
+    mnfcgi_iov_t *iov;
+    size_t niov;
+    size_t sziov;
+    /* end of the region of out already covered by iov */
+    off_t outmark;
+    /* header of the open record of mnfcgi_write(), or -1 */
+    off_t body;
+    uint16_t body_rid;
+    /*
+     * out is being sent by one of the request threads, the others wait
+     * on outcond before they render anything
+     */
+    bool outbusy;
+    mnthr_cond_t outcond;
+    /* running request threads, reqdone is signalled as each exits */
+    size_t nreqthreads;
+    mnthr_cond_t reqdone;
+    /* signalled as request bodies are consumed */
+    mnthr_cond_t bodycond;
+    /*
+     * requests by id, the low ones in reqs, the others in requests, which
+     * is set up on first use
+     */
+#define MNFCGI_CTX_REQS_INLINE 8
+    struct _mnfcgi_request *reqs[MNFCGI_CTX_REQS_INLINE];
     /* strong uint16_t, mnfcgi_request_t */
     mnhash_t requests;
+    bool requests_init;
+    /* in the pool of closed connection contexts */
+    struct _mnfcgi_ctx *next;
 } mnfcgi_ctx_t;
 
 
@@ -327,6 +515,58 @@ typedef enum _mnfcgi_request_method {
 } mnfcgi_request_method_t;
 #define MNFCGI_REQUEST_METHOD_T_DEFINED
 
+/*
+ * RFC 3875 meta-variables, and a few common extensions, that are looked
+ * up by the parser in FCGI_PARAMS.
+ */
+typedef enum _mnfcgi_cgi_var {
+    MNFCGI_CGI_AUTH_TYPE =          0,
+    MNFCGI_CGI_CONTENT_LENGTH =     1,
+    MNFCGI_CGI_CONTENT_TYPE =       2,
+    MNFCGI_CGI_GATEWAY_INTERFACE =  3,
+    MNFCGI_CGI_HTTP_COOKIE =        4,
+    MNFCGI_CGI_HTTP_HOST =          5,
+    MNFCGI_CGI_PATH_INFO =          6,
+    MNFCGI_CGI_PATH_TRANSLATED =    7,
+    MNFCGI_CGI_QUERY_STRING =       8,
+    MNFCGI_CGI_REMOTE_ADDR =        9,
+    MNFCGI_CGI_REMOTE_HOST =        10,
+    MNFCGI_CGI_REMOTE_IDENT =       11,
+    MNFCGI_CGI_REMOTE_USER =        12,
+    MNFCGI_CGI_REQUEST_METHOD =     13,
+    MNFCGI_CGI_REQUEST_SCHEME =     14,
+    MNFCGI_CGI_REQUEST_URI =        15,
+    MNFCGI_CGI_SCRIPT_NAME =        16,
+    MNFCGI_CGI_SERVER_NAME =        17,
+    MNFCGI_CGI_SERVER_PORT =        18,
+    MNFCGI_CGI_SERVER_PROTOCOL =    19,
+    MNFCGI_CGI_SERVER_SOFTWARE =    20,
+    MNFCGI_CGI_COUNT =              21,
+} mnfcgi_cgi_var_t;
+#define MNFCGI_CGI_VAR_T_DEFINED
+
+
+/*
+ * A response header field, both name and value are held.
+ */
+typedef struct _mnfcgi_field {
+    mnbytes_t *name;
+    mnbytes_t *value;
+} mnfcgi_field_t;
+
+
+/*
+ * A path parameter captured by the mnfcgi_app router, as a range of
+ * script_name followed by path_info.
+ */
+#define MNFCGI_ROUTE_MAX_PARAMS 8
+typedef struct _mnfcgi_route_param {
+    const char *name;
+    size_t start;
+    size_t sz;
+} mnfcgi_route_param_t;
+
+
 /*
  * lifetime limited to the execution scope of
  * all mnfcgi_config_t.xxx_(parse|render)
@@ -345,8 +585,6 @@ typedef struct _mnfcgi_request {
         mnfcgi_request_method_t method;
         mnbytes_t *script_name;
         mnbytes_t *path_info;
-        mnhash_t query_terms;
-        mnhash_t cookie;
         mnbytes_t *content_type;
         size_t content_length;
     } info;
@@ -355,12 +593,51 @@ typedef struct _mnfcgi_request {
      * private
      */
     mnfcgi_ctx_t *ctx;
-    /* strong mnbytes_t *, mnbytes_t* */
-    mnhash_t headers;
+    /*
+     * each request runs in an mnthr thread of its own, records are passed
+     * to it through pending
+     */
+    mnthr_ctx_t *thread;
+    STQUEUE(_mnfcgi_header, pending);
+    mnthr_cond_t cond;
+    mnfcgi_arena_t arena;
+    /* response header fields, in the order they were added */
+    mnfcgi_field_t *headers;
+    size_t nheaders;
+    size_t szheaders;
+    /* size of the header fields on the wire */
+    size_t headerssz;
 
     mnfcgi_record_t *begin_request;
     STQUEUE(_mnfcgi_header, params);
-    STQUEUE(_mnfcgi_header, _stdin);
+    mnfcgi_param_table_t param_table;
+    /* index into param_table.params, or -1 */
+    int cgi[MNFCGI_CGI_COUNT];
+    mnfcgi_route_param_t route_params[MNFCGI_ROUTE_MAX_PARAMS];
+    size_t nroute_params;
+    /*
+     * copy of the one route param that spans script_name and path_info,
+     * malloc'ed when the arena is off
+     */
+    char *route_buf;
+    /*
+     * built on the first mnfcgi_request_get_query_term() or
+     * mnfcgi_request_get_cookie(), respectively
+     */
+    mnfcgi_kv_table_t query_terms;
+    mnfcgi_kv_table_t cookies;
+    /*
+     * FCGI_STDIN payload that has not been consumed yet, copied out of
+     * ctx->in.  The ranges of the queued FCGI_STDIN records refer to it.
+     */
+    mnbytestream_t body;
+    /* FCGI_STDIN record being passed to stdin_parse */
+    mnfcgi_record_t *stdin_cur;
+    /* spilled body, see mnfcgi_config_set_stdin_spill() */
+    int spill_fd;
+    size_t spill_sz;
+    off_t spill_rpos;
+    void *spill_map;
     STQUEUE(_mnfcgi_header, data);
     STQUEUE(_mnfcgi_header, _stdout);
     STQUEUE(_mnfcgi_header, _stderr);
@@ -372,6 +649,14 @@ typedef struct _mnfcgi_request {
     int state;
     struct {
         int complete:1;
+        int info:1;
+        /* query_terms, cookies are built */
+        int query_terms:1;
+        int cookie:1;
+        /* body is initialized */
+        int body:1;
+        /* the empty FCGI_STDIN record has arrived */
+        int stdin_end:1;
     } flags;
 } mnfcgi_request_t;
 #define MNFCGI_REQUEST_T_DEFINED
@@ -384,13 +669,47 @@ mnfcgi_record_t *mnfcgi_record_new(uint8_t);
 
 void mnfcgi_record_destroy(mnfcgi_record_t **);
 
-mnfcgi_record_t *mnfcgi_parse(mnbytestream_t *, void *);
+void mnfcgi_record_pool_init(mnfcgi_record_pool_t *, size_t);
+void mnfcgi_record_pool_fini(mnfcgi_record_pool_t *);
+mnfcgi_record_t *mnfcgi_record_pool_get(mnfcgi_record_pool_t *, uint8_t);
+
+ssize_t mnfcgi_frame(mnbytestream_t *);
+mnfcgi_record_t *mnfcgi_parse(mnbytestream_t *,
+                              void *,
+                              mnfcgi_record_pool_t *);
+int mnfcgi_cgi_var(const char *, size_t);
+mnbytes_t *mnfcgi_params_get(mnfcgi_params_t *,
+                             const mnbytes_t *,
+                             mnfcgi_arena_t *);
 
 #define MNFCGI_RENDER_ERROR (-1)
 int mnfcgi_render(mnbytestream_t *, mnfcgi_record_t *, void *);
+void mnfcgi_render_header(mnbytestream_t *,
+                          uint8_t,
+                          uint16_t,
+                          uint16_t,
+                          uint8_t);
 
 void mnfcgi_config_fini(mnfcgi_config_t *);
 void mnfcgi_config_init(mnfcgi_config_t *, const char *, const char *, int, int);
+const char *mnfcgi_config_unix_path(mnfcgi_config_t *);
+int mnfcgi_listen(mnfcgi_config_t *, bool);
+int mnfcgi_serve_fd(mnfcgi_config_t *, int);
+
+/*
+ * util
+ */
+void mnfcgi_arena_init(mnfcgi_arena_t *, size_t);
+void mnfcgi_arena_fini(mnfcgi_arena_t *);
+void *mnfcgi_arena_alloc(mnfcgi_arena_t *, size_t);
+mnbytes_t *mnfcgi_arena_bytes_new_from_str_len(mnfcgi_arena_t *,
+                                               const char *,
+                                               size_t);
+mnbytes_t *mnfcgi_arena_bytes_vprintf(mnfcgi_arena_t *,
+                                      const char *,
+                                      va_list);
+uint64_t mnfcgi_str_hash(const void *, size_t);
+mnbytes_t *mnfcgi_http_date(time_t);
 
 #ifdef __cplusplus
 }
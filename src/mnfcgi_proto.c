@@ -3,8 +3,19 @@
 #include <limits.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h> /* writev */
+#include <sys/un.h>
 #include <unistd.h>
+#if defined(__linux__)
+#   include <sys/sendfile.h>
+#endif
 
 #include <mncommon/bytestream.h>
 #include <mncommon/hash.h>
@@ -16,7 +27,14 @@
 #include "diag.h"
 
 #define MNFCGI_DEFAULT_BYTESTREAM_BUFSZ 1024
-#define MNFCGI_CTX_REQUESTS_HASHLEN 1021
+#define MNFCGI_DEFAULT_RECORD_POOL_CAP 16
+#define MNFCGI_DEFAULT_CTX_POOL_CAP 16
+#define MNFCGI_CTX_POOL_MAX_BUFSZ 0x40000
+#define MNFCGI_DEFAULT_STDOUT_WATERMARK 0x20000
+#define MNFCGI_DEFAULT_STDIN_WATERMARK 0x40000
+#define MNFCGI_DEFAULT_MAX_PARAMS 1024
+#define MNFCGI_DEFAULT_MAX_TERMS 256
+#define MNFCGI_CTX_REQUESTS_HASHLEN 31
 
 
 static mnbytes_t _MNFCGI_MAX_CONNS = BYTES_INITIALIZER(MNFCGI_MAX_CONNS);
@@ -25,16 +43,19 @@ static mnbytes_t _MNFCGI_MAX_REQS = BYTES_INITIALIZER(MNFCGI_MAX_REQS);
 
 static mnbytes_t _status = BYTES_INITIALIZER("Status");
 
-static mnbytes_t _param_request_scheme = BYTES_INITIALIZER("REQUEST_SCHEME");
+static const char _padding[8] = {
+    MNFCGI_PADDING_VALUE,
+    MNFCGI_PADDING_VALUE,
+    MNFCGI_PADDING_VALUE,
+    MNFCGI_PADDING_VALUE,
+    MNFCGI_PADDING_VALUE,
+    MNFCGI_PADDING_VALUE,
+    MNFCGI_PADDING_VALUE,
+    MNFCGI_PADDING_VALUE,
+};
+
 static mnbytes_t _http = BYTES_INITIALIZER("http");
 static mnbytes_t _https = BYTES_INITIALIZER("https");
-static mnbytes_t _param_request_method = BYTES_INITIALIZER("REQUEST_METHOD");
-static mnbytes_t _param_script_name = BYTES_INITIALIZER("SCRIPT_NAME");
-static mnbytes_t _param_path_info = BYTES_INITIALIZER("PATH_INFO");
-static mnbytes_t _param_query_string = BYTES_INITIALIZER("QUERY_STRING");
-static mnbytes_t _param_content_length = BYTES_INITIALIZER("CONTENT_LENGTH");
-static mnbytes_t _param_content_type = BYTES_INITIALIZER("CONTENT_TYPE");
-static mnbytes_t _param_http_cookie = BYTES_INITIALIZER("HTTP_COOKIE");
 
 /*
  * MNFCGI_REQUEST_METHOD_*
@@ -66,6 +87,55 @@ mnfcgi_request_method_str(unsigned m)
     assert(m < countof(mnfcgi_request_methods));
     return mnfcgi_request_methods[m];
 }
+
+
+#define MNFCGI_BYTES_MATCH(s, sz, b)                                   \
+    ((sz) == BSZ(b) - 1 && memcmp((s), BCDATA(b), (sz)) == 0)          \
+
+static mnfcgi_request_method_t
+mnfcgi_request_method_parse(const char *s, size_t sz)
+{
+    switch (sz) {
+    case 3:
+        if (MNFCGI_BYTES_MATCH(s, sz, &_get)) {
+            return MNFCGI_REQUEST_METHOD_GET;
+        } else if (MNFCGI_BYTES_MATCH(s, sz, &_put)) {
+            return MNFCGI_REQUEST_METHOD_PUT;
+        }
+        break;
+
+    case 4:
+        if (MNFCGI_BYTES_MATCH(s, sz, &_post)) {
+            return MNFCGI_REQUEST_METHOD_POST;
+        } else if (MNFCGI_BYTES_MATCH(s, sz, &_head)) {
+            return MNFCGI_REQUEST_METHOD_HEAD;
+        }
+        break;
+
+    case 5:
+        if (MNFCGI_BYTES_MATCH(s, sz, &_patch)) {
+            return MNFCGI_REQUEST_METHOD_PATCH;
+        }
+        break;
+
+    case 6:
+        if (MNFCGI_BYTES_MATCH(s, sz, &_delete)) {
+            return MNFCGI_REQUEST_METHOD_DELETE;
+        }
+        break;
+
+    case 7:
+        if (MNFCGI_BYTES_MATCH(s, sz, &_options)) {
+            return MNFCGI_REQUEST_METHOD_OPTIONS;
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    return MNFCGI_REQUEST_METHOD_UNKNOWN;
+}
 /*
  * mnfcgi_request_t
  */
@@ -87,94 +157,265 @@ mnfcgi_request_item_cmp(void const *a, void const *b)
 }
 
 
-static uint64_t
-_bytes_hash (void const *o)
+/*
+ * Requests of a connection by id.  Web servers number requests from 1, so
+ * low ids index ctx->reqs, and the hash is only set up for the others.
+ */
+static mnfcgi_request_t *
+mnfcgi_ctx_request_get(mnfcgi_ctx_t *ctx, uint16_t rid)
 {
-    mnbytes_t const *b = o;
-    return bytes_hash(b);
+    mnhash_item_t *hit;
+
+    if (MNLIKELY(rid < MNFCGI_CTX_REQS_INLINE)) {
+        return ctx->reqs[rid];
+    }
+    if (!ctx->requests_init ||
+        (hit = hash_get_item(&ctx->requests,
+                             (void *)(uintptr_t)rid)) == NULL) {
+        return NULL;
+    }
+    return hit->value;
 }
 
 
-static int
-_bytes_cmp (void const *oa, void const *ob)
+static void
+mnfcgi_ctx_request_set(mnfcgi_ctx_t *ctx, uint16_t rid, mnfcgi_request_t *req)
 {
-    mnbytes_t const *a = oa, *b = ob;
-    return bytes_cmp(a, b);
+    mnhash_item_t *hit;
+
+    if (MNLIKELY(rid < MNFCGI_CTX_REQS_INLINE)) {
+        ctx->reqs[rid] = req;
+        return;
+    }
+    if (!ctx->requests_init) {
+        hash_init(&ctx->requests,
+                  MNFCGI_CTX_REQUESTS_HASHLEN,
+                  mnfcgi_request_hash,
+                  mnfcgi_request_item_cmp,
+                  /* requests are destroyed by their threads */
+                  NULL);
+        ctx->requests_init = true;
+    }
+    if ((hit = hash_get_item(&ctx->requests,
+                             (void *)(uintptr_t)rid)) != NULL) {
+        hit->value = req;
+    } else {
+        hash_set_item(&ctx->requests, (void *)(uintptr_t)rid, req);
+    }
 }
 
 
-static int
-header_item_fini(void *k, void *v)
+/*
+ * Forget req, unless the id has been reused already.
+ */
+static void
+mnfcgi_ctx_request_del(mnfcgi_ctx_t *ctx, uint16_t rid, mnfcgi_request_t *req)
 {
-    mnbytes_t *key = k, *value = v;
-    BYTES_DECREF(&key);
-    BYTES_DECREF(&value);
-    return 0;
+    mnhash_item_t *hit;
+
+    if (MNLIKELY(rid < MNFCGI_CTX_REQS_INLINE)) {
+        if (ctx->reqs[rid] == req) {
+            ctx->reqs[rid] = NULL;
+        }
+        return;
+    }
+    if (ctx->requests_init &&
+        (hit = hash_get_item(&ctx->requests,
+                             (void *)(uintptr_t)rid)) != NULL &&
+        hit->value == req) {
+        hash_delete_pair(&ctx->requests, hit);
+    }
 }
 
 
 static void
-mnfcgi_request_init(mnfcgi_request_t *req)
+mnfcgi_ctx_requests_complete(mnfcgi_ctx_t *ctx)
 {
-    req->ctx = NULL;
-    hash_init(&req->headers,
-              31,
-              _bytes_hash,
-              _bytes_cmp,
-              header_item_fini);
+    mnfcgi_request_t *req;
+    mnhash_item_t *hit;
+    mnhash_iter_t it;
+    size_t i;
+
+    for (i = 0; i < MNFCGI_CTX_REQS_INLINE; ++i) {
+        if ((req = ctx->reqs[i]) != NULL) {
+            req->flags.complete = -1;
+            mnthr_cond_signal_one(&req->cond);
+        }
+    }
+    if (!ctx->requests_init) {
+        return;
+    }
+    for (hit = hash_first(&ctx->requests, &it);
+         hit != NULL;
+         hit = hash_next(&ctx->requests, &it)) {
+        req = hit->value;
+        req->flags.complete = -1;
+        mnthr_cond_signal_one(&req->cond);
+    }
+}
+
+
+static void
+mnfcgi_request_init(mnfcgi_request_t *req, mnfcgi_ctx_t *ctx)
+{
+    unsigned i;
+
+    req->ctx = ctx;
+    (void)MNFCGI_ATOMIC_ADD(&ctx->config->stats.nrequests, 1);
+    req->thread = NULL;
+    STQUEUE_INIT(&req->pending);
+    mnthr_cond_init(&req->cond);
+    mnfcgi_arena_init(&req->arena, ctx->config->request_arena_sz);
+    req->headers = NULL;
+    req->nheaders = 0;
+    req->szheaders = 0;
+    req->headerssz = 0;
 
     req->info.scheme = MNFCGI_REQUEST_SCHEME_HTTP;
     req->info.method = MNFCGI_REQUEST_METHOD_GET;
     req->info.script_name = NULL;
     req->info.path_info = NULL;
-    hash_init(&req->info.query_terms,
-              31,
-              _bytes_hash,
-              _bytes_cmp,
-              header_item_fini);
-    hash_init(&req->info.cookie,
-              17,
-              _bytes_hash,
-              _bytes_cmp,
-              header_item_fini);
     req->info.content_type = NULL;
     req->info.content_length = 0;
     req->udata = NULL;
 
     req->begin_request = NULL;
     STQUEUE_INIT(&req->params);
-    STQUEUE_INIT(&req->_stdin);
+    req->param_table.buf = NULL;
+    req->param_table.params = NULL;
+    req->param_table.nparams = 0;
+    req->param_table.slots = NULL;
+    req->param_table.nslots = 0;
+    req->param_table.data = NULL;
+    for (i = 0; i < countof(req->cgi); ++i) {
+        req->cgi[i] = -1;
+    }
+    req->nroute_params = 0;
+    req->route_buf = NULL;
+    memset(&req->body, '\0', sizeof(req->body));
+    req->stdin_cur = NULL;
+    req->spill_fd = -1;
+    req->spill_sz = 0;
+    req->spill_rpos = 0;
+    req->spill_map = NULL;
     STQUEUE_INIT(&req->data);
     STQUEUE_INIT(&req->_stdout);
     STQUEUE_INIT(&req->_stderr);
     req->state = 0;
     req->flags.complete = 0;
+    req->flags.info = 0;
+    req->query_terms.kvs = NULL;
+    req->query_terms.nkvs = 0;
+    req->cookies.kvs = NULL;
+    req->cookies.nkvs = 0;
+    req->flags.query_terms = 0;
+    req->flags.cookie = 0;
+    req->flags.body = 0;
+    req->flags.stdin_end = 0;
 }
 
 
 static mnfcgi_request_t *
-mnfcgi_request_new(void)
+mnfcgi_request_new(mnfcgi_ctx_t *ctx)
 {
     mnfcgi_request_t *req;
 
     if (MNUNLIKELY((req = malloc(sizeof(mnfcgi_request_t))) == NULL)) {
         FAIL("malloc");
     }
-    mnfcgi_request_init(req);
+    mnfcgi_request_init(req, ctx);
     return req;
 }
 
 
 
+static void
+mnfcgi_request_param_table_fini(mnfcgi_request_t *req)
+{
+    mnfcgi_param_table_t *t;
+    size_t i;
+
+    t = &req->param_table;
+    for (i = 0; i < t->nparams; ++i) {
+        BYTES_DECREF(&t->params[i].bvalue);
+    }
+    if (t->buf != NULL && req->arena.chunksz == 0) {
+        free(t->buf);
+    }
+    t->buf = NULL;
+    t->params = NULL;
+    t->nparams = 0;
+    t->slots = NULL;
+    t->nslots = 0;
+    t->data = NULL;
+}
+
+
+/*
+ * Whether a queued record refers to ctx->in.  The payload of FCGI_STDIN
+ * is copied out to req->body, so that ctx->in can be compacted while a
+ * large body is streamed.
+ */
+static bool
+mnfcgi_record_pins_in(mnfcgi_record_t *rec)
+{
+    switch (rec->header.type) {
+    case MNFCGI_PARAMS:
+        return rec->params.nparams > 0;
+
+    case MNFCGI_DATA:
+        return rec->header.rsz > 0;
+
+    default:
+        return false;
+    }
+}
+
+
+static void
+mnfcgi_kv_table_fini(mnfcgi_request_t *req, mnfcgi_kv_table_t *t)
+{
+    size_t i;
+
+    for (i = 0; i < t->nkvs; ++i) {
+        BYTES_DECREF(&t->kvs[i].bvalue);
+    }
+    if (t->kvs != NULL && req->arena.chunksz == 0) {
+        free(t->kvs);
+    }
+    t->kvs = NULL;
+    t->nkvs = 0;
+}
+
+
+static void mnfcgi_request_fields_clear(mnfcgi_request_t *);
+static int mnfcgi_ctx_out_wait(mnfcgi_ctx_t *);
+static void mnfcgi_ctx_body_close(mnfcgi_ctx_t *);
+
 static void
 mnfcgi_request_fini(mnfcgi_request_t *req)
 {
     mnfcgi_header_t *h;
 
+    while ((h = STQUEUE_HEAD(&req->pending)) != NULL) {
+        mnfcgi_record_t *rec;
+
+        STQUEUE_DEQUEUE(&req->pending, link);
+        rec = (mnfcgi_record_t *)h;
+        if (mnfcgi_record_pins_in(rec)) {
+            --req->ctx->npinned;
+        }
+        mnfcgi_record_destroy(&rec);
+    }
+    mnthr_cond_fini(&req->cond);
+    req->thread = NULL;
+
     BYTES_DECREF(&req->info.script_name);
     BYTES_DECREF(&req->info.path_info);
-    hash_fini(&req->info.query_terms);
-    hash_fini(&req->info.cookie);
+    mnfcgi_kv_table_fini(req, &req->query_terms);
+    req->flags.query_terms = 0;
+    mnfcgi_kv_table_fini(req, &req->cookies);
+    req->flags.cookie = 0;
     BYTES_DECREF(&req->info.content_type);
 
     mnfcgi_record_destroy(&req->begin_request);
@@ -184,15 +425,24 @@ mnfcgi_request_fini(mnfcgi_request_t *req)
 
         STQUEUE_DEQUEUE(&req->params, link);
         rec = (mnfcgi_record_t *)h;
+        if (rec->params.nparams > 0) {
+            --req->ctx->npinned;
+        }
         mnfcgi_record_destroy(&rec);
     }
+    mnfcgi_request_param_table_fini(req);
 
-    while ((h = STQUEUE_HEAD(&req->_stdin)) != NULL) {
-        mnfcgi_record_t *rec;
-
-        STQUEUE_DEQUEUE(&req->_stdin, link);
-        rec = (mnfcgi_record_t *)h;
-        mnfcgi_record_destroy(&rec);
+    if (req->flags.body) {
+        bytestream_fini(&req->body);
+        req->flags.body = 0;
+    }
+    if (req->spill_map != NULL) {
+        (void)munmap(req->spill_map, req->spill_sz);
+        req->spill_map = NULL;
+    }
+    if (req->spill_fd != -1) {
+        close(req->spill_fd);
+        req->spill_fd = -1;
     }
 
     while ((h = STQUEUE_HEAD(&req->data)) != NULL) {
@@ -200,6 +450,9 @@ mnfcgi_request_fini(mnfcgi_request_t *req)
 
         STQUEUE_DEQUEUE(&req->data, link);
         rec = (mnfcgi_record_t *)h;
+        if (rec->header.rsz > 0) {
+            --req->ctx->npinned;
+        }
         mnfcgi_record_destroy(&rec);
     }
 
@@ -219,15 +472,30 @@ mnfcgi_request_fini(mnfcgi_request_t *req)
         mnfcgi_record_destroy(&rec);
     }
 
-    hash_fini(&req->headers);
+    mnfcgi_request_fields_clear(req);
+    if (req->headers != NULL) {
+        free(req->headers);
+        req->headers = NULL;
+    }
+    req->szheaders = 0;
 
-    if (req->ctx->config->end_request_render != NULL) {
-        ssize_t nwritten;
-        if (MNUNLIKELY((nwritten = req->ctx->config->end_request_render(
-                            NULL, &req->ctx->out, req)) < 0)) {
-        }
+    if (req->route_buf != NULL && req->arena.chunksz == 0) {
+        free(req->route_buf);
+    }
+    req->route_buf = NULL;
+    req->nroute_params = 0;
+
+    if (req->ctx->config->end_request_render != NULL &&
+        mnfcgi_ctx_out_wait(req->ctx) == 0) {
+        /* not inside a STDOUT record left open by another request */
+        mnfcgi_ctx_body_close(req->ctx);
+        (void)req->ctx->config->end_request_render(NULL,
+                                                   &req->ctx->out,
+                                                   req);
     }
 
+    mnfcgi_arena_fini(&req->arena);
+    (void)MNFCGI_ATOMIC_SUB(&req->ctx->config->stats.nrequests, 1);
     req->ctx = NULL;
 }
 
@@ -243,12 +511,185 @@ mnfcgi_request_destroy(mnfcgi_request_t **req)
 }
 
 
-static int
-mnfcgi_request_item_fini(UNUSED void *key, void *value)
+/*
+ * Merge the parameters of all FCGI_PARAMS records received so far into
+ * req->param_table, and release the records.  The first occurrence of a
+ * name wins, parameters over config->max_params are dropped.
+ */
+static void
+mnfcgi_request_merge_params(mnfcgi_request_t *req)
 {
-    mnfcgi_request_t *req = value;
-    mnfcgi_request_destroy(&req);
-    return 0;
+    mnfcgi_param_table_t *t;
+    mnfcgi_header_t *h;
+    size_t nparams, szdata, sz, max, n;
+    char *data;
+    bool dropped;
+
+    t = &req->param_table;
+    assert(t->buf == NULL);
+
+    max = req->ctx->config->max_params > 0 ?
+        req->ctx->config->max_params : SIZE_MAX;
+    nparams = 0;
+    szdata = 0;
+    for (h = STQUEUE_HEAD(&req->params);
+         h != NULL && nparams < max;
+         h = STQUEUE_NEXT(link, h)) {
+        mnfcgi_params_t *rec;
+        size_t i;
+
+        rec = (mnfcgi_params_t *)h;
+        for (i = 0; i < rec->nparams && nparams < max; ++i, ++nparams) {
+            szdata += (rec->params[i].name.end - rec->params[i].name.start) +
+                      (rec->params[i].value.end - rec->params[i].value.start) +
+                      2;
+        }
+    }
+
+    for (t->nslots = 8; t->nslots < nparams * 2; t->nslots <<= 1) {
+        ;
+    }
+
+    sz = nparams * sizeof(mnfcgi_param_t) +
+         t->nslots * sizeof(mnfcgi_param_slot_t) +
+         szdata;
+    if (req->arena.chunksz > 0) {
+        t->buf = mnfcgi_arena_alloc(&req->arena, sz);
+    } else {
+        if (MNUNLIKELY((t->buf = malloc(sz)) == NULL)) {
+            FAIL("malloc");
+        }
+    }
+    t->params = t->buf;
+    t->slots = (mnfcgi_param_slot_t *)(t->params + nparams);
+    t->data = (char *)(t->slots + t->nslots);
+    memset(t->slots, '\0', t->nslots * sizeof(mnfcgi_param_slot_t));
+    t->nparams = 0;
+
+    n = 0;
+    dropped = false;
+    data = t->data;
+    while ((h = STQUEUE_HEAD(&req->params)) != NULL) {
+        mnfcgi_params_t *rec;
+        mnfcgi_record_t *tmp;
+        size_t i;
+
+        rec = (mnfcgi_params_t *)h;
+        for (i = 0; i < rec->nparams; ++i) {
+            mnfcgi_param_t *p;
+            size_t ksz, vsz, j;
+            uint64_t hash;
+
+            /* space is only reserved for the first nparams */
+            if (n == nparams) {
+                dropped = true;
+                break;
+            }
+            ++n;
+            p = &rec->params[i];
+            ksz = p->name.end - p->name.start;
+            vsz = p->value.end - p->value.start;
+            hash = mnfcgi_str_hash(SDATA(rec->bs, p->name.start), ksz);
+
+            for (j = hash & (t->nslots - 1);
+                 t->slots[j].idx != 0;
+                 j = (j + 1) & (t->nslots - 1)) {
+                mnfcgi_param_t *q;
+
+                q = &t->params[t->slots[j].idx - 1];
+                if (t->slots[j].hash == (uint32_t)hash &&
+                    (size_t)(q->name.end - q->name.start) == ksz &&
+                    memcmp(t->data + q->name.start,
+                           SDATA(rec->bs, p->name.start),
+                           ksz) == 0) {
+                    break;
+                }
+            }
+            if (t->slots[j].idx != 0) {
+                /* duplicate */
+                continue;
+            }
+
+            memcpy(data, SDATA(rec->bs, p->name.start), ksz);
+            data[ksz] = '\0';
+            memcpy(data + ksz + 1, SDATA(rec->bs, p->value.start), vsz);
+            data[ksz + 1 + vsz] = '\0';
+
+            t->params[t->nparams].name.start = data - t->data;
+            t->params[t->nparams].name.end = data - t->data + ksz;
+            t->params[t->nparams].value.start = data - t->data + ksz + 1;
+            t->params[t->nparams].value.end = data - t->data + ksz + 1 + vsz;
+            /* the value may have been looked up already */
+            t->params[t->nparams].bvalue = p->bvalue;
+            p->bvalue = NULL;
+            t->params[t->nparams].cgi = p->cgi;
+            if (p->cgi >= 0) {
+                req->cgi[p->cgi] = t->nparams;
+            }
+            data += ksz + vsz + 2;
+
+            ++t->nparams;
+            t->slots[j].hash = (uint32_t)hash;
+            t->slots[j].idx = t->nparams;
+        }
+
+        STQUEUE_DEQUEUE(&req->params, link);
+        if (rec->nparams > 0) {
+            --req->ctx->npinned;
+        }
+        tmp = (mnfcgi_record_t *)h;
+        mnfcgi_record_destroy(&tmp);
+    }
+
+    if (dropped) {
+        CTRACE("more than %zu params, dropped the rest", nparams);
+    }
+}
+
+
+static mnbytes_t *
+mnfcgi_request_param_table_value(mnfcgi_request_t *req, size_t idx)
+{
+    mnfcgi_param_t *p;
+
+    p = &req->param_table.params[idx];
+    if (p->bvalue == NULL) {
+        p->bvalue = mnfcgi_arena_bytes_new_from_str_len(
+                &req->arena,
+                req->param_table.data + p->value.start,
+                p->value.end - p->value.start);
+        BYTES_INCREF(p->bvalue);
+    }
+    return p->bvalue;
+}
+
+
+static mnbytes_t *
+mnfcgi_request_param_table_get(mnfcgi_request_t *req, const mnbytes_t *name)
+{
+    mnfcgi_param_table_t *t;
+    size_t sz, j;
+    uint64_t hash;
+
+    t = &req->param_table;
+    sz = BSZ(name) - 1;
+    hash = mnfcgi_str_hash(BCDATA(name), sz);
+
+    for (j = hash & (t->nslots - 1);
+         t->slots[j].idx != 0;
+         j = (j + 1) & (t->nslots - 1)) {
+        mnfcgi_param_t *p;
+
+        p = &t->params[t->slots[j].idx - 1];
+        if (t->slots[j].hash == (uint32_t)hash &&
+            (size_t)(p->name.end - p->name.start) == sz &&
+            memcmp(t->data + p->name.start, BCDATA(name), sz) == 0) {
+            return mnfcgi_request_param_table_value(req,
+                                                    t->slots[j].idx - 1);
+        }
+    }
+
+    return NULL;
 }
 
 
@@ -259,16 +700,20 @@ mnfcgi_request_get_param(mnfcgi_request_t *req,
     mnbytes_t *res;
     mnfcgi_header_t *h;
 
+    if (req->param_table.buf != NULL) {
+        return mnfcgi_request_param_table_get(req, name);
+    }
+
     res = NULL;
     for (h = STQUEUE_HEAD(&req->params);
          h != NULL;
          h = STQUEUE_NEXT(link, h)) {
         mnfcgi_record_t *rec;
-        mnhash_item_t *hit;
 
         rec = (mnfcgi_record_t *)h;
-        if ((hit = hash_get_item(&rec->params.params, name)) != NULL) {
-            res = hit->value;
+        if ((res = mnfcgi_params_get(&rec->params,
+                                     name,
+                                     &req->arena)) != NULL) {
             break;
         }
     }
@@ -277,1075 +722,2661 @@ mnfcgi_request_get_param(mnfcgi_request_t *req,
 }
 
 
+/*
+ * Return a well-known parameter, or NULL if it was not sent, or the
+ * FCGI_PARAMS stream is not complete yet.
+ */
 mnbytes_t *
-mnfcgi_request_get_query_term(mnfcgi_request_t *req,
-                              const mnbytes_t *name)
+mnfcgi_request_get_cgi(mnfcgi_request_t *req, mnfcgi_cgi_var_t var)
 {
-    mnbytes_t *res;
-    mnhash_item_t *hit;
-
-    res = NULL;
-    if ((hit = hash_get_item(&req->info.query_terms, name)) != NULL) {
-        res = hit->value;
+    assert(var < MNFCGI_CGI_COUNT);
+    if (req->cgi[var] < 0) {
+        return NULL;
     }
-
-    return res;
+    return mnfcgi_request_param_table_value(req, req->cgi[var]);
 }
 
 
-int
-mnfcgi_request_get_query_term_intmax(mnfcgi_request_t *req,
-                                     const mnbytes_t *name,
-                                     int radix,
-                                     intmax_t *rv)
+static const char *
+mnfcgi_request_cgi_data(mnfcgi_request_t *req,
+                        mnfcgi_cgi_var_t var,
+                        size_t *sz)
 {
-    int res = 0;
-    mnbytes_t *v;
-
-    v = mnfcgi_request_get_query_term(req, name);
-    if (bytes_is_null_or_empty(v)) {
-        res = MNFCGI_GET_QTN_ENULL;
-        goto end;
-    }
+    mnfcgi_param_t *p;
 
-    *rv = strtoimax(BCDATA(v), NULL, radix);
-    if (*rv == 0 && errno == EINVAL) {
-        res = MNFCGI_GET_QTN_EINVAL;
+    if (req->cgi[var] < 0) {
+        return NULL;
     }
-
-end:
-    return res;
+    p = &req->param_table.params[req->cgi[var]];
+    *sz = p->value.end - p->value.start;
+    return req->param_table.data + p->value.start;
 }
 
 
-int
-mnfcgi_request_get_query_term_double(mnfcgi_request_t *req,
-                                     const mnbytes_t *name,
-                                     UNUSED int radix,
-                                     double *rv)
+/*
+ * Query terms and cookies.  The QUERY_STRING and HTTP_COOKIE values are
+ * split into ranges on first access, and a value is percent-decoded only
+ * when it is asked for.
+ */
+static int
+mnfcgi_hexdigit(int c)
 {
-    int res = 0;
-    mnbytes_t *v;
-
-    v = mnfcgi_request_get_query_term(req, name);
-    if (bytes_is_null_or_empty(v)) {
-        res = MNFCGI_GET_QTN_ENULL;
-        goto end;
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
     }
+    return -1;
+}
 
-    *rv = strtod(BCDATA(v), NULL);
-    if (errno == ERANGE) {
-        res = MNFCGI_GET_QTN_EINVAL;
-    }
 
-end:
-    return res;
+/*
+ * Return the decoded character at s[*i], and advance *i past it.
+ * Malformed escapes are taken literally.  With plus, '+' stands for a
+ * space, as in the query string.
+ */
+static int
+mnfcgi_pct_next(const char *s, size_t sz, size_t *i, bool plus)
+{
+    int c;
+
+    c = (unsigned char)s[*i];
+    ++(*i);
+    if (c == '%' && *i + 1 < sz) {
+        int hi, lo;
+
+        hi = mnfcgi_hexdigit((unsigned char)s[*i]);
+        lo = mnfcgi_hexdigit((unsigned char)s[*i + 1]);
+        if (hi >= 0 && lo >= 0) {
+            c = (hi << 4) | lo;
+            *i += 2;
+        }
+    } else if (c == '+' && plus) {
+        c = ' ';
+    }
+    return c;
 }
 
 
-mnbytes_t *
-mnfcgi_request_get_cookie(mnfcgi_request_t *req,
-                          mnbytes_t *name)
+/*
+ * Decode sz bytes of s to dst, which may be s itself.  Return the decoded
+ * length.
+ */
+#ifndef UNITTEST
+static
+#endif
+size_t
+_mnfcgi_pct_decode(char *dst, const char *s, size_t sz, bool plus)
 {
-    mnbytes_t *res;
-    mnhash_item_t *hit;
+    size_t i, n;
 
-    res = NULL;
-    if ((hit = hash_get_item(&req->info.cookie, name)) != NULL) {
-        res = hit->value;
+    for (i = 0, n = 0; i < sz; ++n) {
+        dst[n] = (char)mnfcgi_pct_next(s, sz, &i, plus);
     }
-
-    return res;
+    return n;
 }
 
 
-void
-mnfcgi_request_fill_info(mnfcgi_request_t *req)
+static bool
+mnfcgi_pct_match(const char *s, size_t sz, const mnbytes_t *name, bool plus)
 {
-    mnbytes_t *value;
-
-    if (MNLIKELY(
-        (value = mnfcgi_request_get_param(req,
-                                          &_param_request_scheme)) != NULL)) {
-        if (bytes_cmp(value, &_http) == 0) {
-            req->info.scheme = MNFCGI_REQUEST_SCHEME_HTTP;
-        } else if (bytes_cmp(value, &_https) == 0) {
-            req->info.scheme = MNFCGI_REQUEST_SCHEME_HTTPS;
+    const unsigned char *p;
+    size_t i, j, n;
+
+    p = (const unsigned char *)BCDATA(name);
+    n = BSZ(name) - 1;
+    for (i = 0, j = 0; i < sz; ++j) {
+        if (j == n || mnfcgi_pct_next(s, sz, &i, plus) != p[j]) {
+            return false;
         }
     }
+    return j == n;
+}
 
-    if (MNLIKELY(
-        (value = mnfcgi_request_get_param(req,
-                                          &_param_request_method)) != NULL)) {
-        if (bytes_cmp(value, &_get) == 0) {
-            req->info.method = MNFCGI_REQUEST_METHOD_GET;
-        } else if (bytes_cmp(value, &_post) == 0) {
-            req->info.method = MNFCGI_REQUEST_METHOD_POST;
-        } else if (bytes_cmp(value, &_head) == 0) {
-            req->info.method = MNFCGI_REQUEST_METHOD_HEAD;
-        } else if (bytes_cmp(value, &_put) == 0) {
-            req->info.method = MNFCGI_REQUEST_METHOD_PUT;
-        } else if (bytes_cmp(value, &_delete) == 0) {
-            req->info.method = MNFCGI_REQUEST_METHOD_DELETE;
-        } else if (bytes_cmp(value, &_patch) == 0) {
-            req->info.method = MNFCGI_REQUEST_METHOD_PATCH;
-        } else if (bytes_cmp(value, &_options) == 0) {
-            req->info.method = MNFCGI_REQUEST_METHOD_OPTIONS;
-        } else {
-            req->info.method = MNFCGI_REQUEST_METHOD_UNKNOWN;
-        }
-    }
-
-    if (MNLIKELY(
-        (value = mnfcgi_request_get_param(req,
-                                          &_param_script_name)) != NULL)) {
-        req->info.script_name = value;
-        BYTES_INCREF(value);
-    }
 
-    if (MNLIKELY(
-        (value = mnfcgi_request_get_param(req,
-                                          &_param_path_info)) != NULL)) {
-        req->info.path_info = value;
-        BYTES_INCREF(value);
-    }
+/*
+ * Split sz bytes of s into at most n key=value pairs separated by sep, with
+ * offsets from s - off.  A pair without '=' has an empty value, a pair
+ * with an empty key is skipped.  Cookie pairs are separated by "; ", the
+ * whitespace is dropped.  Return the number of pairs.
+ */
+#ifndef UNITTEST
+static
+#endif
+size_t
+_mnfcgi_kv_split(const char *s,
+                 size_t sz,
+                 char sep,
+                 size_t off,
+                 mnfcgi_kv_t *kvs,
+                 size_t n)
+{
+    size_t i, nkvs;
 
-    if (MNLIKELY(
-        (value = mnfcgi_request_get_param(req,
-                                          &_param_query_string)) != NULL)) {
-        (void)mnhttp_parse_qterms(value, '=', '&', &req->info.query_terms);
-    }
+    i = 0;
+    nkvs = 0;
+    while (i < sz && nkvs < n) {
+        const char *p;
+        size_t end, eq;
 
-    if ((value = mnfcgi_request_get_param(req, &_param_http_cookie)) != NULL) {
-        (void)mnhttp_parse_kvpbd(value, '=', '&', &req->info.cookie);
+        if (sep == ';') {
+            while (i < sz && (s[i] == ' ' || s[i] == '\t')) {
+                ++i;
+            }
+        }
+        end = (p = memchr(s + i, sep, sz - i)) != NULL ?
+            (size_t)(p - s) : sz;
+        eq = (p = memchr(s + i, '=', end - i)) != NULL ?
+            (size_t)(p - s) : end;
+
+        if (eq > i) {
+            mnfcgi_kv_t *kv;
+
+            kv = &kvs[nkvs++];
+            kv->key = off + i;
+            kv->keysz = eq - i;
+            kv->value = off + (eq < end ? eq + 1 : end);
+            kv->valuesz = end - (eq < end ? eq + 1 : end);
+            kv->bvalue = NULL;
+        }
+        i = end + 1;
     }
+    return nkvs;
+}
 
-    if (MNLIKELY(
-        (value = mnfcgi_request_get_param(req,
-                                          &_param_content_length)) != NULL)) {
-        req->info.content_length = strtoimax(BCDATA(value), NULL, 10);
-    }
 
-    if (MNLIKELY(
-        (value = mnfcgi_request_get_param(req,
-                                          &_param_content_type)) != NULL)) {
-        req->info.content_type = value;
-        BYTES_INCREF(value);
+/*
+ * The first pair whose decoded key is name, offsets are from data.
+ */
+#ifndef UNITTEST
+static
+#endif
+mnfcgi_kv_t *
+_mnfcgi_kv_find(const char *data,
+                mnfcgi_kv_t *kvs,
+                size_t nkvs,
+                const mnbytes_t *name,
+                bool plus)
+{
+    size_t i;
+
+    for (i = 0; i < nkvs; ++i) {
+        if (mnfcgi_pct_match(data + kvs[i].key,
+                             kvs[i].keysz,
+                             name,
+                             plus)) {
+            return &kvs[i];
+        }
     }
-
+    return NULL;
 }
 
 
-int PRINTFLIKE(4, 5)
-mnfcgi_request_field_addf(mnfcgi_request_t *req,
-                          int flags,
-                          mnbytes_t *name,
-                          const char *fmt,
-                          ...)
+/*
+ * Split the value of var, pairs over config->max_terms are dropped.
+ * Lookups are linear.
+ */
+static void
+mnfcgi_kv_table_parse(mnfcgi_request_t *req,
+                      mnfcgi_kv_table_t *t,
+                      mnfcgi_cgi_var_t var,
+                      char sep)
 {
-    int res;
-    mnbytes_t *value;
-    mnhash_item_t *hit;
-    va_list ap;
-
-    assert(!((flags & MNFCGI_FADD_IFNOEXISTS) &&
-             (flags & MNFCGI_FADD_OVERRIDE)));
-    assert(name != NULL);
-
-    if (MNUNLIKELY(req->state > MNFCGI_REQUEST_STATE_HEADERS_ALLOWED)) {
-        return MNFCGI_REQUEST_STATE;
-    }
-    res = 0;
+    const char *s;
+    size_t sz, i, n;
 
-    hit = hash_get_item(&req->headers, name);
-    if ((flags & MNFCGI_FADD_IFNOEXISTS) && (hit != NULL)) {
-        return MNFCGI_FADD_DUP;
+    if ((s = mnfcgi_request_cgi_data(req, var, &sz)) == NULL || sz == 0) {
+        return;
     }
 
-    va_start(ap, fmt);
-    value = bytes_vprintf(fmt, ap);
-    va_end(ap);
-
-    if (hit != NULL) {
-        if (flags & MNFCGI_FADD_OVERRIDE) {
-            mnbytes_t *v;
-
-            /* unique */
-            v = hit->value;
-            BYTES_DECREF(&v);
-            hit->value = value;
-            BYTES_INCREF(value);
-
-        } else {
-            /* dup */
-            hash_set_item(&req->headers, name, value);
-            BYTES_INCREF(name);
-            BYTES_INCREF(value);
-            res = MNFCGI_FADD_DUP;
+    for (i = 0, n = 1; i < sz; ++i) {
+        if (s[i] == sep) {
+            ++n;
         }
+    }
+    if (req->ctx->config->max_terms > 0 && n > req->ctx->config->max_terms) {
+        CTRACE("more than %zu terms, dropping the rest",
+               req->ctx->config->max_terms);
+        n = req->ctx->config->max_terms;
+    }
+    if (req->arena.chunksz > 0) {
+        t->kvs = mnfcgi_arena_alloc(&req->arena, sizeof(mnfcgi_kv_t) * n);
     } else {
-        hash_set_item(&req->headers, name, value);
-        BYTES_INCREF(name);
-        BYTES_INCREF(value);
+        if (MNUNLIKELY((t->kvs = malloc(sizeof(mnfcgi_kv_t) * n)) == NULL)) {
+            FAIL("malloc");
+        }
     }
 
-    return res;
+    t->nkvs = _mnfcgi_kv_split(s,
+                               sz,
+                               sep,
+                               s - req->param_table.data,
+                               t->kvs,
+                               n);
 }
 
 
-int
-mnfcgi_request_field_addb(mnfcgi_request_t *req,
-                          int flags,
-                          mnbytes_t *name,
-                          mnbytes_t *value)
+static mnfcgi_kv_t *
+mnfcgi_kv_table_get(mnfcgi_request_t *req,
+                    mnfcgi_kv_table_t *t,
+                    const mnbytes_t *name,
+                    bool plus)
 {
-    int res;
-    mnhash_item_t *hit;
+    return _mnfcgi_kv_find(req->param_table.data,
+                           t->kvs,
+                           t->nkvs,
+                           name,
+                           plus);
+}
 
-    assert(!((flags & MNFCGI_FADD_IFNOEXISTS) &&
-             (flags & MNFCGI_FADD_OVERRIDE)));
 
-    if (MNUNLIKELY(req->state > MNFCGI_REQUEST_STATE_HEADERS_ALLOWED)) {
-        return MNFCGI_REQUEST_STATE;
+static mnbytes_t *
+mnfcgi_kv_value(mnfcgi_request_t *req, mnfcgi_kv_t *kv, bool plus)
+{
+    if (kv->bvalue == NULL) {
+        const char *s;
+
+        s = req->param_table.data + kv->value;
+        kv->bvalue = mnfcgi_arena_bytes_new_from_str_len(&req->arena,
+                                                         s,
+                                                         kv->valuesz);
+        if (memchr(s, '%', kv->valuesz) != NULL ||
+            (plus && memchr(s, '+', kv->valuesz) != NULL)) {
+            size_t n;
+
+            n = _mnfcgi_pct_decode((char *)BDATA(kv->bvalue),
+                                  BCDATA(kv->bvalue),
+                                  kv->valuesz,
+                                  plus);
+            BDATA(kv->bvalue)[n] = '\0';
+            kv->bvalue->sz = n + 1;
+        }
+        /* released in mnfcgi_kv_table_fini() */
+        BYTES_INCREF(kv->bvalue);
     }
-    res = 0;
+    return kv->bvalue;
+}
 
-    hit = hash_get_item(&req->headers, name);
-    if ((flags & MNFCGI_FADD_IFNOEXISTS) && (hit != NULL)) {
-        return MNFCGI_FADD_DUP;
+
+static mnfcgi_kv_t *
+mnfcgi_request_query_term(mnfcgi_request_t *req, const mnbytes_t *name)
+{
+    if (!req->flags.query_terms) {
+        /* not until the params are complete */
+        if (req->param_table.buf == NULL) {
+            return NULL;
+        }
+        req->flags.query_terms = -1;
+        mnfcgi_kv_table_parse(req,
+                              &req->query_terms,
+                              MNFCGI_CGI_QUERY_STRING,
+                              '&');
     }
+    return mnfcgi_kv_table_get(req, &req->query_terms, name, true);
+}
 
-    if (hit != NULL) {
 
-        if (flags & MNFCGI_FADD_OVERRIDE) {
-            mnbytes_t *v;
+mnbytes_t *
+mnfcgi_request_get_query_term(mnfcgi_request_t *req,
+                              const mnbytes_t *name)
+{
+    mnfcgi_kv_t *kv;
 
-            /* unique */
-            v = hit->value;
-            BYTES_DECREF(&v);
-            hit->value = value;
-            BYTES_INCREF(value);
-
-        } else {
-            /* dup */
-            hash_set_item(&req->headers, name, value);
-            BYTES_INCREF(name);
-            BYTES_INCREF(value);
-            res = MNFCGI_FADD_DUP;
-        }
-    } else {
-        hash_set_item(&req->headers, name, value);
-        BYTES_INCREF(name);
-        BYTES_INCREF(value);
+    if ((kv = mnfcgi_request_query_term(req, name)) == NULL) {
+        return NULL;
     }
-
-    return res;
+    return mnfcgi_kv_value(req, kv, true);
 }
 
 
-int
-mnfcgi_request_field_addt(mnfcgi_request_t *req,
-                          int flags,
-                          mnbytes_t *name,
-                          time_t t)
+/*
+ * Numbers are decoded on the stack, only a value that does not fit is
+ * decoded into the arena.
+ */
+#define MNFCGI_QTN_BUFSZ 64
+
+static const char *
+mnfcgi_request_query_term_num(mnfcgi_request_t *req,
+                              const mnbytes_t *name,
+                              char *buf)
 {
-    int res;
-    mnhash_item_t *hit;
-    mnbytes_t *value;
+    mnfcgi_kv_t *kv;
     size_t n;
-    char buf[64];
-    struct tm *tv;
-
-    assert(!((flags & MNFCGI_FADD_IFNOEXISTS) &&
-             (flags & MNFCGI_FADD_OVERRIDE)));
 
-    if (MNUNLIKELY(req->state > MNFCGI_REQUEST_STATE_HEADERS_ALLOWED)) {
-        return MNFCGI_REQUEST_STATE;
+    if ((kv = mnfcgi_request_query_term(req, name)) == NULL ||
+        kv->valuesz == 0) {
+        return NULL;
     }
-    res = 0;
-
-    hit = hash_get_item(&req->headers, name);
-    if ((flags & MNFCGI_FADD_IFNOEXISTS) && (hit != NULL)) {
-        return MNFCGI_FADD_DUP;
+    if (kv->bvalue != NULL || kv->valuesz >= MNFCGI_QTN_BUFSZ) {
+        return BCDATA(mnfcgi_kv_value(req, kv, true));
     }
+    n = _mnfcgi_pct_decode(buf,
+                          req->param_table.data + kv->value,
+                          kv->valuesz,
+                          true);
+    buf[n] = '\0';
+    return buf;
+}
 
-    // Wdy, DD Mmm YYYY HH:MM:SS GMT
-    tv = gmtime(&t);
-    n = strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT",
-                 tv);
-    value = bytes_new_from_str_len(buf, n);
 
-    if (hit != NULL) {
-        if (flags & MNFCGI_FADD_OVERRIDE) {
-            mnbytes_t *v;
+int
+mnfcgi_request_get_query_term_intmax(mnfcgi_request_t *req,
+                                     const mnbytes_t *name,
+                                     int radix,
+                                     intmax_t *rv)
+{
+    int res = 0;
+    char buf[MNFCGI_QTN_BUFSZ];
+    const char *v;
 
-            /* unique */
-            v = hit->value;
-            BYTES_DECREF(&v);
-            hit->value = value;
-            BYTES_INCREF(value);
-
-        } else {
-            /* dup */
-            hash_set_item(&req->headers, name, value);
-            BYTES_INCREF(name);
-            BYTES_INCREF(value);
-            res = MNFCGI_FADD_DUP;
-        }
-    } else {
-        hash_set_item(&req->headers, name, value);
-        BYTES_INCREF(name);
-        BYTES_INCREF(value);
+    if ((v = mnfcgi_request_query_term_num(req, name, buf)) == NULL) {
+        res = MNFCGI_GET_QTN_ENULL;
+        goto end;
+    }
+
+    errno = 0;
+    *rv = strtoimax(v, NULL, radix);
+    if (*rv == 0 && errno == EINVAL) {
+        res = MNFCGI_GET_QTN_EINVAL;
     }
 
+end:
     return res;
 }
 
 
 int
-mnfcgi_request_status_set(mnfcgi_request_t *req,
-                          int status,
-                          mnbytes_t *text)
+mnfcgi_request_get_query_term_double(mnfcgi_request_t *req,
+                                     const mnbytes_t *name,
+                                     UNUSED int radix,
+                                     double *rv)
 {
-    assert(text != NULL);
-    return mnfcgi_request_field_addf(req,
-                                     MNFCGI_FADD_OVERRIDE,
-                                     &_status,
-                                     "%d %s",
-                                     status,
-                                     BDATA(text));
-}
-
+    int res = 0;
+    char buf[MNFCGI_QTN_BUFSZ];
+    const char *v;
 
-static ssize_t
-mnfcgi_render_headers(UNUSED mnfcgi_record_t *rec,
-                      mnbytestream_t *bs,
-                      void *udata)
-{
-    mnfcgi_request_t *req;
-    ssize_t nwritten;
-    mnhash_iter_t it;
-    mnhash_item_t *hit0, *hit1;
+    if ((v = mnfcgi_request_query_term_num(req, name, buf)) == NULL) {
+        res = MNFCGI_GET_QTN_ENULL;
+        goto end;
+    }
 
-    req = udata;
-    nwritten = 0;
+    errno = 0;
+    *rv = strtod(v, NULL);
+    if (errno == ERANGE) {
+        res = MNFCGI_GET_QTN_EINVAL;
+    }
 
-#define MNFCGI_RENDER_HEADERS_FMT "%s: %s\r\n"
-    for (hit0 = hash_first(&req->headers, &it);
-         hit0 != NULL;
-         ) {
-        mnbytes_t *name, *value;
-        ssize_t n;
+end:
+    return res;
+}
 
-        name = hit0->key;
-        value = hit0->value;
 
-        assert(name != NULL);
+mnbytes_t *
+mnfcgi_request_get_cookie(mnfcgi_request_t *req,
+                          mnbytes_t *name)
+{
+    mnfcgi_kv_t *kv;
 
-        if (value == NULL) {
-            n = BSZ(name) + sizeof(MNFCGI_RENDER_HEADERS_FMT);
-            if (n >= MNFCGI_MAX_PAYLOAD) {
-                /* discard too long headers */
-                hit1 = hash_next(&req->headers, &it);
-                hash_delete_pair(&req->headers, hit0);
-                hit0 = hit1;
-            } else {
-                if ((nwritten + n) < MNFCGI_MAX_PAYLOAD) {
-                    nwritten += mnfcgi_printf(bs,
-                                              MNFCGI_RENDER_HEADERS_FMT,
-                                              BDATA(name),
-                                              "");
-                    hit1 = hash_next(&req->headers, &it);
-                    hash_delete_pair(&req->headers, hit0);
-                    hit0 = hit1;
-                } else {
-                    break;
-                }
-            }
-        } else {
-            n = BSZ(name) + BSZ(value) + sizeof(MNFCGI_RENDER_HEADERS_FMT);
-            if (n >= MNFCGI_MAX_PAYLOAD) {
-                /* discard too long headers */
-                hit1 = hash_next(&req->headers, &it);
-                hash_delete_pair(&req->headers, hit0);
-                hit0 = hit1;
-            } else {
-                if ((nwritten + n) < MNFCGI_MAX_PAYLOAD) {
-                    nwritten += mnfcgi_printf(bs,
-                                              MNFCGI_RENDER_HEADERS_FMT,
-                                              BDATA(name),
-                                              BDATA(value));
-                    hit1 = hash_next(&req->headers, &it);
-                    hash_delete_pair(&req->headers, hit0);
-                    hit0 = hit1;
-                } else {
-                    break;
-                }
-            }
+    if (!req->flags.cookie) {
+        /* not until the params are complete */
+        if (req->param_table.buf == NULL) {
+            return NULL;
         }
+        req->flags.cookie = -1;
+        mnfcgi_kv_table_parse(req,
+                              &req->cookies,
+                              MNFCGI_CGI_HTTP_COOKIE,
+                              ';');
     }
-
-    return nwritten;
+    if ((kv = mnfcgi_kv_table_get(req, &req->cookies, name, false)) == NULL) {
+        return NULL;
+    }
+    return mnfcgi_kv_value(req, kv, false);
 }
 
 
-static ssize_t
-mnfcgi_render_empty_line(UNUSED mnfcgi_record_t *rec,
-                         mnbytestream_t *bs,
-                         UNUSED void *udata)
-{
-    return mnfcgi_cat(bs, 2, "\r\n");
-}
-
-int
-mnfcgi_request_headers_end(mnfcgi_request_t *req)
+/*
+ * Fill in req->info from the well-known parameters.  Has no effect before
+ * the FCGI_PARAMS stream is complete, or when called again.
+ */
+void
+mnfcgi_request_fill_info(mnfcgi_request_t *req)
 {
-    int res;
+    mnbytes_t *value;
+    const char *s;
+    size_t sz;
 
-    res = 0;
-    if (MNUNLIKELY(req->state > MNFCGI_REQUEST_STATE_HEADERS_ALLOWED)) {
-        return MNFCGI_REQUEST_STATE;
+    if (req->flags.info || req->param_table.buf == NULL) {
+        return;
     }
+    req->flags.info = -1;
 
-    while (!hash_is_empty(&req->headers)) {
-        if ((res = mnfcgi_render_stdout(req,
-                                        mnfcgi_render_headers,
-                                        NULL)) != 0) {
-            break;
+    if (MNLIKELY((s = mnfcgi_request_cgi_data(
+                    req, MNFCGI_CGI_REQUEST_SCHEME, &sz)) != NULL)) {
+        if (MNFCGI_BYTES_MATCH(s, sz, &_http)) {
+            req->info.scheme = MNFCGI_REQUEST_SCHEME_HTTP;
+        } else if (MNFCGI_BYTES_MATCH(s, sz, &_https)) {
+            req->info.scheme = MNFCGI_REQUEST_SCHEME_HTTPS;
         }
     }
 
-    res = mnfcgi_render_stdout(req, mnfcgi_render_empty_line, NULL);
+    if (MNLIKELY((s = mnfcgi_request_cgi_data(
+                    req, MNFCGI_CGI_REQUEST_METHOD, &sz)) != NULL)) {
+        req->info.method = mnfcgi_request_method_parse(s, sz);
+    }
 
-    req->state = MNFCGI_REQUEST_STATE_HEADERS_END;
-    return res;
+    if (MNLIKELY((value = mnfcgi_request_get_cgi(
+                    req, MNFCGI_CGI_SCRIPT_NAME)) != NULL)) {
+        req->info.script_name = value;
+        BYTES_INCREF(value);
+    }
+
+    if (MNLIKELY((value = mnfcgi_request_get_cgi(
+                    req, MNFCGI_CGI_PATH_INFO)) != NULL)) {
+        req->info.path_info = value;
+        BYTES_INCREF(value);
+    }
+
+    /* query terms and cookies are parsed on demand */
+
+    /* values in the parameter table are nul-terminated */
+    if (MNLIKELY((s = mnfcgi_request_cgi_data(
+                    req, MNFCGI_CGI_CONTENT_LENGTH, &sz)) != NULL)) {
+        req->info.content_length = strtoimax(s, NULL, 10);
+    }
+
+    if (MNLIKELY((value = mnfcgi_request_get_cgi(
+                    req, MNFCGI_CGI_CONTENT_TYPE)) != NULL)) {
+        req->info.content_type = value;
+        BYTES_INCREF(value);
+    }
 }
 
 
 /*
- * mnfcgi_config_t
+ * Response header fields.  They are kept in the order they were added,
+ * along with their size on the wire.
  */
-void
-mnfcgi_config_init(mnfcgi_config_t *config,
-            const char *host,
-            const char *port,
-            int max_conn,
-            int max_req)
-{
-    assert(host != NULL);
-    assert(port != NULL);
-    assert(max_conn > 0);
+#define MNFCGI_FIELD_LEN(b) ((b) != NULL && BSZ(b) > 0 ? BSZ(b) - 1 : 0)
+#define MNFCGI_FIELD_WIRESZ(name, value)       \
+    (MNFCGI_FIELD_LEN(name) + 2 + MNFCGI_FIELD_LEN(value) + 2)  \
 
-    config->nref = 0;
-    config->host = bytes_new_from_str(host);
-    BYTES_INCREF(config->host);
 
-    config->port = bytes_new_from_str(port);
-    BYTES_INCREF(config->port);
+static mnfcgi_field_t *
+mnfcgi_request_field_find(mnfcgi_request_t *req, mnbytes_t *name)
+{
+    size_t i;
 
-    config->max_conn = max_conn;
-    config->max_req = max_req;
-    config->fd = -1;
+    for (i = 0; i < req->nheaders; ++i) {
+        mnfcgi_field_t *f;
 
-    config->params_parse = NULL;
-    config->stdin_parse = NULL;
-    config->data_parse = NULL;
-    config->stdout_render = NULL;
-    config->stderr_render = NULL;
-    config->udata = NULL;
-    config->stats.nthreads = 0;
+        f = &req->headers[i];
+        if (f->name == name ||
+            (BSZ(f->name) == BSZ(name) &&
+             memcmp(BDATA(f->name), BDATA(name), BSZ(name)) == 0)) {
+            return f;
+        }
+    }
+    return NULL;
 }
 
 
-void
-mnfcgi_config_fini(mnfcgi_config_t *config)
+static void
+mnfcgi_request_field_append(mnfcgi_request_t *req,
+                            mnbytes_t *name,
+                            mnbytes_t *value)
 {
-    if (config->fd != -1) {
-        close(config->fd);
-        config->fd = -1;
+    mnfcgi_field_t *f;
+
+    if (req->nheaders == req->szheaders) {
+        size_t szheaders;
+
+        szheaders = req->szheaders > 0 ? req->szheaders * 2 : 8;
+        if (MNUNLIKELY((f = realloc(req->headers,
+                                    sizeof(mnfcgi_field_t) *
+                                    szheaders)) == NULL)) {
+            FAIL("realloc");
+        }
+        req->headers = f;
+        req->szheaders = szheaders;
     }
-    BYTES_DECREF(&config->host);
-    BYTES_DECREF(&config->port);
+
+    f = &req->headers[req->nheaders++];
+    f->name = name;
+    BYTES_INCREF(name);
+    f->value = value;
+    BYTES_INCREF(value);
+    req->headerssz += MNFCGI_FIELD_WIRESZ(name, value);
 }
 
 
-mnfcgi_stats_t *
-mnfcgi_config_get_stats(mnfcgi_config_t *config)
+static void
+mnfcgi_request_field_replace(mnfcgi_request_t *req,
+                             mnfcgi_field_t *f,
+                             mnbytes_t *value)
 {
-    return &config->stats;
+    req->headerssz -= MNFCGI_FIELD_WIRESZ(f->name, f->value);
+    BYTES_INCREF(value);
+    BYTES_DECREF(&f->value);
+    f->value = value;
+    req->headerssz += MNFCGI_FIELD_WIRESZ(f->name, f->value);
 }
 
 
-/*
- * mnfcgi_ctx_t
- */
 static void
-mnfcgi_ctx_init(mnfcgi_ctx_t *ctx,
-                mnfcgi_config_t *config,
-                int fd)
+mnfcgi_request_fields_clear(mnfcgi_request_t *req)
 {
-    ctx->config = config;
-    MNFCGI_CONFIG_INCREF(ctx->config);
-    ctx->thread = NULL;
-    ctx->fd = fd;
-    ctx->fp = (void *)(intptr_t)fd;
+    size_t i;
 
-    bytestream_init(&ctx->in,
-                    MNFCGI_DEFAULT_BYTESTREAM_BUFSZ);
-    ctx->in.read_more = mnthr_bytestream_read_more;
-
-    bytestream_init(&ctx->out,
-                    MNFCGI_DEFAULT_BYTESTREAM_BUFSZ);
-    ctx->out.write = mnthr_bytestream_write;
-
-    hash_init(&ctx->requests,
-              MNFCGI_CTX_REQUESTS_HASHLEN,
-              mnfcgi_request_hash,
-              mnfcgi_request_item_cmp,
-              mnfcgi_request_item_fini);
+    for (i = 0; i < req->nheaders; ++i) {
+        BYTES_DECREF(&req->headers[i].name);
+        BYTES_DECREF(&req->headers[i].value);
+    }
+    req->nheaders = 0;
+    req->headerssz = 0;
 }
 
-static void
-mnfcgi_ctx_fini(mnfcgi_ctx_t *ctx)
+
+/*
+ * Add value, which is not held yet, under name.  The field found earlier
+ * is either replaced, or a duplicate is added after all the others.
+ */
+static int
+mnfcgi_request_field_set(mnfcgi_request_t *req,
+                         int flags,
+                         mnfcgi_field_t *f,
+                         mnbytes_t *name,
+                         mnbytes_t *value)
 {
-    if (ctx->fd != -1) {
+    if (f != NULL) {
+        if (flags & MNFCGI_FADD_OVERRIDE) {
+            /* unique */
+            mnfcgi_request_field_replace(req, f, value);
+            return 0;
+        }
+        /* dup */
+        mnfcgi_request_field_append(req, name, value);
+        return MNFCGI_FADD_DUP;
+    }
+
+    mnfcgi_request_field_append(req, name, value);
+    return 0;
+}
+
+
+int PRINTFLIKE(4, 5)
+mnfcgi_request_field_addf(mnfcgi_request_t *req,
+                          int flags,
+                          mnbytes_t *name,
+                          const char *fmt,
+                          ...)
+{
+    mnbytes_t *value;
+    mnfcgi_field_t *f;
+    va_list ap;
+
+    assert(!((flags & MNFCGI_FADD_IFNOEXISTS) &&
+             (flags & MNFCGI_FADD_OVERRIDE)));
+    assert(name != NULL);
+
+    if (MNUNLIKELY(req->state > MNFCGI_REQUEST_STATE_HEADERS_ALLOWED)) {
+        return MNFCGI_REQUEST_STATE;
+    }
+
+    f = mnfcgi_request_field_find(req, name);
+    if ((flags & MNFCGI_FADD_IFNOEXISTS) && (f != NULL)) {
+        return MNFCGI_FADD_DUP;
+    }
+
+    va_start(ap, fmt);
+    value = mnfcgi_arena_bytes_vprintf(&req->arena, fmt, ap);
+    va_end(ap);
+
+    return mnfcgi_request_field_set(req, flags, f, name, value);
+}
+
+
+int
+mnfcgi_request_field_addb(mnfcgi_request_t *req,
+                          int flags,
+                          mnbytes_t *name,
+                          mnbytes_t *value)
+{
+    mnfcgi_field_t *f;
+
+    assert(!((flags & MNFCGI_FADD_IFNOEXISTS) &&
+             (flags & MNFCGI_FADD_OVERRIDE)));
+    assert(name != NULL);
+    assert(value != NULL);
+
+    if (MNUNLIKELY(req->state > MNFCGI_REQUEST_STATE_HEADERS_ALLOWED)) {
+        return MNFCGI_REQUEST_STATE;
+    }
+
+    f = mnfcgi_request_field_find(req, name);
+    if ((flags & MNFCGI_FADD_IFNOEXISTS) && (f != NULL)) {
+        return MNFCGI_FADD_DUP;
+    }
+
+    return mnfcgi_request_field_set(req, flags, f, name, value);
+}
+
+
+int
+mnfcgi_request_field_addt(mnfcgi_request_t *req,
+                          int flags,
+                          mnbytes_t *name,
+                          time_t t)
+{
+    mnfcgi_field_t *f;
+
+    assert(!((flags & MNFCGI_FADD_IFNOEXISTS) &&
+             (flags & MNFCGI_FADD_OVERRIDE)));
+    assert(name != NULL);
+
+    if (MNUNLIKELY(req->state > MNFCGI_REQUEST_STATE_HEADERS_ALLOWED)) {
+        return MNFCGI_REQUEST_STATE;
+    }
+
+    f = mnfcgi_request_field_find(req, name);
+    if ((flags & MNFCGI_FADD_IFNOEXISTS) && (f != NULL)) {
+        return MNFCGI_FADD_DUP;
+    }
+
+    /* shared, see mnfcgi_http_date() */
+    return mnfcgi_request_field_set(req,
+                                    flags,
+                                    f,
+                                    name,
+                                    mnfcgi_http_date(t));
+}
+
+
+int
+mnfcgi_request_status_set(mnfcgi_request_t *req,
+                          int status,
+                          mnbytes_t *text)
+{
+    assert(text != NULL);
+    return mnfcgi_request_field_addf(req,
+                                     MNFCGI_FADD_OVERRIDE,
+                                     &_status,
+                                     "%d %s",
+                                     status,
+                                     BDATA(text));
+}
+
+
+/*
+ * Render all header fields and the empty line in one go, their size is
+ * known in advance.
+ */
+int
+mnfcgi_request_headers_end(mnfcgi_request_t *req)
+{
+    int res;
+    size_t sz, i;
+    char *buf, *p;
+
+    if (MNUNLIKELY(req->state > MNFCGI_REQUEST_STATE_HEADERS_ALLOWED)) {
+        return MNFCGI_REQUEST_STATE;
+    }
+
+    sz = req->headerssz + 2;
+    if (req->arena.chunksz > 0) {
+        buf = mnfcgi_arena_alloc(&req->arena, sz);
+    } else {
+        if (MNUNLIKELY((buf = malloc(sz)) == NULL)) {
+            FAIL("malloc");
+        }
+    }
+
+    p = buf;
+    for (i = 0; i < req->nheaders; ++i) {
+        mnfcgi_field_t *f;
+        size_t n;
+
+        f = &req->headers[i];
+        n = MNFCGI_FIELD_LEN(f->name);
+        memcpy(p, BDATA(f->name), n);
+        p += n;
+        *p++ = ':';
+        *p++ = ' ';
+        n = MNFCGI_FIELD_LEN(f->value);
+        memcpy(p, BDATA(f->value), n);
+        p += n;
+        *p++ = '\r';
+        *p++ = '\n';
+    }
+    *p++ = '\r';
+    *p++ = '\n';
+    assert((size_t)(p - buf) == sz);
+
+    mnfcgi_request_fields_clear(req);
+
+    res = mnfcgi_write(req, buf, sz);
+    if (req->arena.chunksz == 0) {
+        free(buf);
+    }
+
+    req->state = MNFCGI_REQUEST_STATE_HEADERS_END;
+    return res;
+}
+
+
+/*
+ * mnfcgi_config_t
+ */
+
+/*
+ * Return the path of a local socket, @name in the abstract namespace, or
+ * NULL for an inet socket.
+ */
+const char *
+mnfcgi_config_unix_path(mnfcgi_config_t *config)
+{
+    if (config->family != PF_LOCAL) {
+        return NULL;
+    }
+    return BCDATA(config->host) + sizeof(MNFCGI_UNIX_PREFIX) - 1;
+}
+
+
+void
+mnfcgi_config_init(mnfcgi_config_t *config,
+            const char *host,
+            const char *port,
+            int max_conn,
+            int max_req)
+{
+    assert(host != NULL);
+    assert(max_conn > 0);
+
+    config->nref = 0;
+    config->host = bytes_new_from_str(host);
+    BYTES_INCREF(config->host);
+
+    if (strncmp(host,
+                MNFCGI_UNIX_PREFIX,
+                sizeof(MNFCGI_UNIX_PREFIX) - 1) == 0) {
+        config->family = PF_LOCAL;
+        port = "";
+    } else {
+        assert(port != NULL);
+        config->family = PF_INET;
+    }
+    config->port = bytes_new_from_str(port);
+    BYTES_INCREF(config->port);
+    config->unix_mode = (mode_t)-1;
+    config->unix_uid = (uid_t)-1;
+    config->unix_gid = (gid_t)-1;
+
+    config->max_conn = max_conn;
+    config->max_req = max_req;
+    config->fd = -1;
+    config->request_arena_sz = 0;
+    config->record_pool_cap = MNFCGI_DEFAULT_RECORD_POOL_CAP;
+    config->ctx_pool_cap = MNFCGI_DEFAULT_CTX_POOL_CAP;
+    config->stdout_watermark = MNFCGI_DEFAULT_STDOUT_WATERMARK;
+    config->stdin_watermark = MNFCGI_DEFAULT_STDIN_WATERMARK;
+    config->stdin_spill = 0;
+    config->stdin_spill_dir = NULL;
+    config->max_params = MNFCGI_DEFAULT_MAX_PARAMS;
+    config->max_terms = MNFCGI_DEFAULT_MAX_TERMS;
+    config->nworkers = 0;
+    config->worker = -1;
+    config->cpus = NULL;
+    config->ncpus = 0;
+    config->npthreads = 0;
+    config->reuseport = false;
+
+    config->params_parse = NULL;
+    config->stdin_parse = NULL;
+    config->data_parse = NULL;
+    config->stdout_render = NULL;
+    config->stderr_render = NULL;
+    config->udata = NULL;
+    config->stats.nthreads = 0;
+    config->stats.nrecords_reused = 0;
+    config->stats.nrecords_allocated = 0;
+    config->stats.nrequests = 0;
+    config->stats.noverloaded = 0;
+}
+
+
+void
+mnfcgi_config_fini(mnfcgi_config_t *config)
+{
+    if (config->fd != -1) {
+        const char *path;
+
+        close(config->fd);
+        config->fd = -1;
+        /* prefork workers share the socket of the supervisor */
+        if ((path = mnfcgi_config_unix_path(config)) != NULL &&
+            *path != '@' &&
+            config->worker == -1) {
+            (void)unlink(path);
+        }
+    }
+    BYTES_DECREF(&config->host);
+    BYTES_DECREF(&config->port);
+    BYTES_DECREF(&config->stdin_spill_dir);
+    if (config->cpus != NULL) {
+        free(config->cpus);
+        config->cpus = NULL;
+    }
+    config->ncpus = 0;
+}
+
+
+mnfcgi_stats_t *
+mnfcgi_config_get_stats(mnfcgi_config_t *config)
+{
+    return &config->stats;
+}
+
+
+/*
+ * Allocate request scoped data (parameter values, response header values)
+ * from a per-request arena of chunks of the given size.  Zero turns it
+ * off.  Values obtained from a request must not be kept past the request
+ * when the arena is on.
+ */
+void
+mnfcgi_config_set_request_arena(mnfcgi_config_t *config, size_t sz)
+{
+    config->request_arena_sz = sz;
+}
+
+
+/*
+ * Keep at most cap spare records of each type per connection.  Zero turns
+ * pooling off.
+ */
+void
+mnfcgi_config_set_record_pool(mnfcgi_config_t *config, size_t cap)
+{
+    config->record_pool_cap = cap;
+}
+
+
+/*
+ * Keep up to cap contexts of closed connections per OS thread, with their
+ * buffers and records, for the connections accepted next.  Zero turns
+ * pooling off.
+ */
+void
+mnfcgi_config_set_ctx_pool(mnfcgi_config_t *config, size_t cap)
+{
+    config->ctx_pool_cap = cap;
+}
+
+
+/*
+ * Flush the output of mnfcgi_write() once this many bytes are pending.
+ * Zero leaves it to mnfcgi_flush_out() and mnfcgi_finalize_request().
+ */
+void
+mnfcgi_config_set_stdout_watermark(mnfcgi_config_t *config, size_t sz)
+{
+    config->stdout_watermark = sz;
+}
+
+
+/*
+ * Stop reading the connection while this many bytes of a request body
+ * are waiting to be consumed.  Zero buffers bodies without limit.
+ */
+void
+mnfcgi_config_set_stdin_watermark(mnfcgi_config_t *config, size_t sz)
+{
+    config->stdin_watermark = sz;
+}
+
+
+/*
+ * Limit the number of request parameters, and the number of query terms
+ * or cookies.  The rest are ignored.  Zero means no limit.
+ */
+void
+mnfcgi_config_set_max_params(mnfcgi_config_t *config, size_t nparams)
+{
+    config->max_params = nparams;
+}
+
+
+void
+mnfcgi_config_set_max_terms(mnfcgi_config_t *config, size_t nterms)
+{
+    config->max_terms = nterms;
+}
+
+
+/*
+ * Write request bodies with a Content-Length over sz to a file as they
+ * arrive, instead of passing them to stdin_parse.  The file is created in
+ * dir, or is a memfd if dir is NULL and memfd_create() is available, else
+ * it goes to $TMPDIR.  Zero turns spilling off.
+ */
+void
+mnfcgi_config_set_stdin_spill(mnfcgi_config_t *config,
+                              size_t sz,
+                              const char *dir)
+{
+    config->stdin_spill = sz;
+    BYTES_DECREF(&config->stdin_spill_dir);
+    if (dir != NULL) {
+        config->stdin_spill_dir = bytes_new_from_str(dir);
+        BYTES_INCREF(config->stdin_spill_dir);
+    }
+}
+
+
+/*
+ * Number of worker processes for mnfcgi_prefork().
+ */
+void
+mnfcgi_config_set_workers(mnfcgi_config_t *config, int nworkers)
+{
+    config->nworkers = nworkers;
+}
+
+
+/*
+ * Pin worker i to cpus[i % ncpus].  An empty set turns pinning off.
+ */
+void
+mnfcgi_config_set_worker_cpus(mnfcgi_config_t *config,
+                              const int *cpus,
+                              size_t ncpus)
+{
+    if (config->cpus != NULL) {
+        free(config->cpus);
+        config->cpus = NULL;
+    }
+    config->ncpus = 0;
+
+    if (ncpus > 0) {
+        if (MNUNLIKELY((config->cpus = malloc(sizeof(int) * ncpus)) == NULL)) {
+            FAIL("malloc");
+        }
+        memcpy(config->cpus, cpus, sizeof(int) * ncpus);
+        config->ncpus = ncpus;
+    }
+}
+
+
+/*
+ * Number of OS threads for mnfcgi_run_pthreads().
+ */
+void
+mnfcgi_config_set_pthreads(mnfcgi_config_t *config, int npthreads)
+{
+    config->npthreads = npthreads;
+}
+
+
+/*
+ * Give each process or OS thread a SO_REUSEPORT listener of its own.
+ */
+void
+mnfcgi_config_set_reuseport(mnfcgi_config_t *config, bool reuseport)
+{
+    config->reuseport = reuseport;
+}
+
+
+/*
+ * Permissions and owner of a unix:/path socket, -1 leaves them as they
+ * are.
+ */
+void
+mnfcgi_config_set_unix_perms(mnfcgi_config_t *config,
+                             mode_t mode,
+                             uid_t uid,
+                             gid_t gid)
+{
+    config->unix_mode = mode;
+    config->unix_uid = uid;
+    config->unix_gid = gid;
+}
+
+
+/*
+ * Index of this worker process, or -1 outside of mnfcgi_prefork() workers.
+ */
+int
+mnfcgi_config_get_worker(mnfcgi_config_t *config)
+{
+    return config->worker;
+}
+
+
+/*
+ * mnfcgi_ctx_t
+ */
+/*
+ * Per-connection state.  The buffers, the record pool and the iov array
+ * outlive the connection when the context goes back to the pool.
+ */
+static void
+mnfcgi_ctx_start(mnfcgi_ctx_t *ctx, mnfcgi_config_t *config, int fd)
+{
+    ctx->config = config;
+    MNFCGI_CONFIG_INCREF(ctx->config);
+    ctx->thread = NULL;
+    ctx->fd = fd;
+    ctx->fp = (void *)(intptr_t)fd;
+    ctx->pool.cap = config->record_pool_cap;
+    ctx->npinned = 0;
+    ctx->niov = 0;
+    ctx->outmark = 0;
+    ctx->body = -1;
+    ctx->body_rid = MNFCGI_RID_NULL;
+    ctx->outbusy = false;
+    mnthr_cond_init(&ctx->outcond);
+    ctx->nreqthreads = 0;
+    mnthr_cond_init(&ctx->reqdone);
+    mnthr_cond_init(&ctx->bodycond);
+
+    memset(ctx->reqs, '\0', sizeof(ctx->reqs));
+    ctx->requests_init = false;
+}
+
+
+static void
+mnfcgi_ctx_init(mnfcgi_ctx_t *ctx,
+                mnfcgi_config_t *config,
+                int fd)
+{
+    bytestream_init(&ctx->in,
+                    MNFCGI_DEFAULT_BYTESTREAM_BUFSZ);
+    ctx->in.read_more = mnthr_bytestream_read_more;
+
+    bytestream_init(&ctx->out,
+                    MNFCGI_DEFAULT_BYTESTREAM_BUFSZ);
+    ctx->out.write = mnthr_bytestream_write;
+
+    mnfcgi_record_pool_init(&ctx->pool, config->record_pool_cap);
+    ctx->iov = NULL;
+    ctx->sziov = 0;
+    ctx->next = NULL;
+
+    mnfcgi_ctx_start(ctx, config, fd);
+}
+
+static void mnfcgi_ctx_out_reset(mnfcgi_ctx_t *);
+
+static void
+mnfcgi_ctx_stop(mnfcgi_ctx_t *ctx)
+{
+    if (ctx->fd != -1) {
         close(ctx->fd);
         ctx->fd = -1;
     }
-    ctx->fp = (void *)-1;
-    hash_fini(&ctx->requests);
-    bytestream_fini(&ctx->in);
-    bytestream_fini(&ctx->out);
-    MNFCGI_CONFIG_DECREF(&ctx->config);
+    ctx->fp = (void *)-1;
+    if (ctx->requests_init) {
+        hash_fini(&ctx->requests);
+        ctx->requests_init = false;
+    }
+    mnthr_cond_fini(&ctx->outcond);
+    mnthr_cond_fini(&ctx->reqdone);
+    mnthr_cond_fini(&ctx->bodycond);
+    (void)MNFCGI_ATOMIC_ADD(&ctx->config->stats.nrecords_reused,
+                            ctx->pool.nhits);
+    (void)MNFCGI_ATOMIC_ADD(&ctx->config->stats.nrecords_allocated,
+                            ctx->pool.nmisses);
+    ctx->pool.nhits = 0;
+    ctx->pool.nmisses = 0;
+    mnfcgi_ctx_out_reset(ctx);
+    bytestream_rewind(&ctx->in);
+    MNFCGI_CONFIG_DECREF(&ctx->config);
+}
+
+
+static void
+mnfcgi_ctx_fini(mnfcgi_ctx_t *ctx)
+{
+    mnfcgi_ctx_stop(ctx);
+    mnfcgi_record_pool_fini(&ctx->pool);
+    if (ctx->iov != NULL) {
+        free(ctx->iov);
+        ctx->iov = NULL;
+    }
+    ctx->sziov = 0;
+    bytestream_fini(&ctx->in);
+    bytestream_fini(&ctx->out);
+}
+
+
+/*
+ * Contexts of closed connections, kept for the next accepted socket along
+ * with their buffers, up to MNFCGI_CTX_POOL_MAX_BUFSZ each.  There is one
+ * pool per OS thread, as there is one mnthr loop.  Connection threads may
+ * outlive mnfcgi_serve_fd(), so once it has returned the last of them
+ * drains the pool.
+ */
+static __thread struct {
+    mnfcgi_ctx_t *head;
+    size_t n;
+    size_t nlive;
+    bool stopping;
+} _ctx_pool = { NULL, 0, 0, false };
+
+static void mnfcgi_ctx_pool_fini(void);
+
+
+/*
+ * A buffer that grew past MNFCGI_CTX_POOL_MAX_BUFSZ, for example on a
+ * large unflushed response, is started over before the context is pooled.
+ */
+static void
+mnfcgi_ctx_shrink(mnfcgi_ctx_t *ctx)
+{
+    if (ctx->in.buf.sz > MNFCGI_CTX_POOL_MAX_BUFSZ) {
+        bytestream_fini(&ctx->in);
+        bytestream_init(&ctx->in, MNFCGI_DEFAULT_BYTESTREAM_BUFSZ);
+        ctx->in.read_more = mnthr_bytestream_read_more;
+    }
+    if (ctx->out.buf.sz > MNFCGI_CTX_POOL_MAX_BUFSZ) {
+        bytestream_fini(&ctx->out);
+        bytestream_init(&ctx->out, MNFCGI_DEFAULT_BYTESTREAM_BUFSZ);
+        ctx->out.write = mnthr_bytestream_write;
+    }
+}
+
+
+static mnfcgi_ctx_t *
+mnfcgi_ctx_new(mnfcgi_config_t *config, int fd)
+{
+    mnfcgi_ctx_t *ctx;
+
+    ++_ctx_pool.nlive;
+    if ((ctx = _ctx_pool.head) != NULL) {
+        _ctx_pool.head = ctx->next;
+        --_ctx_pool.n;
+        ctx->next = NULL;
+        mnfcgi_ctx_start(ctx, config, fd);
+    } else {
+        if (MNUNLIKELY((ctx = malloc(sizeof(mnfcgi_ctx_t))) == NULL)) {
+            FAIL("malloc");
+        }
+        mnfcgi_ctx_init(ctx, config, fd);
+    }
+    return ctx;
+}
+
+
+static void
+mnfcgi_ctx_destroy(mnfcgi_ctx_t **pctx)
+{
+    mnfcgi_ctx_t *ctx;
+
+    ctx = *pctx;
+    assert(_ctx_pool.nlive > 0);
+    --_ctx_pool.nlive;
+    if (!_ctx_pool.stopping &&
+        _ctx_pool.n < ctx->config->ctx_pool_cap) {
+        mnfcgi_ctx_stop(ctx);
+        mnfcgi_ctx_shrink(ctx);
+        ctx->next = _ctx_pool.head;
+        _ctx_pool.head = ctx;
+        ++_ctx_pool.n;
+    } else {
+        mnfcgi_ctx_fini(ctx);
+        free(ctx);
+    }
+    *pctx = NULL;
+    if (_ctx_pool.stopping && _ctx_pool.nlive == 0) {
+        mnfcgi_ctx_pool_fini();
+    }
+}
+
+
+static void
+mnfcgi_ctx_pool_fini(void)
+{
+    mnfcgi_ctx_t *ctx;
+
+    while ((ctx = _ctx_pool.head) != NULL) {
+        _ctx_pool.head = ctx->next;
+        mnfcgi_record_pool_fini(&ctx->pool);
+        if (ctx->iov != NULL) {
+            free(ctx->iov);
+        }
+        bytestream_fini(&ctx->in);
+        bytestream_fini(&ctx->out);
+        free(ctx);
+    }
+    _ctx_pool.n = 0;
+}
+
+
+/*
+ * Scatter-gather output.  Data rendered into ctx->out and data passed by
+ * reference are sent in the order they were added.
+ */
+static void
+mnfcgi_ctx_iov_add(mnfcgi_ctx_t *ctx,
+                   mnbytes_t *ref,
+                   const char *data,
+                   off_t off,
+                   size_t sz)
+{
+    mnfcgi_iov_t *iov;
+
+    if (ctx->niov == ctx->sziov) {
+        size_t sziov;
+
+        sziov = ctx->sziov > 0 ? ctx->sziov * 2 : 16;
+        if (MNUNLIKELY((iov = realloc(ctx->iov,
+                                      sizeof(mnfcgi_iov_t) *
+                                      sziov)) == NULL)) {
+            FAIL("realloc");
+        }
+        ctx->iov = iov;
+        ctx->sziov = sziov;
+    }
+
+    iov = &ctx->iov[ctx->niov++];
+    iov->ref = ref;
+    if (ref != NULL) {
+        BYTES_INCREF(ref);
+    }
+    iov->data = data;
+    iov->fd = -1;
+    iov->off = off;
+    iov->sz = sz;
+}
+
+
+static void
+mnfcgi_ctx_iov_add_fd(mnfcgi_ctx_t *ctx, int fd, off_t off, size_t sz)
+{
+    mnfcgi_ctx_iov_add(ctx, NULL, NULL, off, sz);
+    ctx->iov[ctx->niov - 1].fd = fd;
+}
+
+
+/*
+ * Cover what was rendered into ctx->out since the last span.
+ */
+static void
+mnfcgi_ctx_iov_cut(mnfcgi_ctx_t *ctx)
+{
+    if (SEOD(&ctx->out) > ctx->outmark) {
+        mnfcgi_ctx_iov_add(ctx,
+                           NULL,
+                           NULL,
+                           ctx->outmark,
+                           SEOD(&ctx->out) - ctx->outmark);
+        ctx->outmark = SEOD(&ctx->out);
+    }
+}
+
+
+static void
+mnfcgi_ctx_out_reset(mnfcgi_ctx_t *ctx)
+{
+    size_t i;
+
+    for (i = 0; i < ctx->niov; ++i) {
+        BYTES_DECREF(&ctx->iov[i].ref);
+    }
+    ctx->niov = 0;
+    ctx->outmark = 0;
+    ctx->body = -1;
+    bytestream_rewind(&ctx->out);
+}
+
+
+/*
+ * Finish the open record of mnfcgi_write(), if any.  Must be done before
+ * anything else is rendered into ctx->out.
+ */
+static void
+mnfcgi_ctx_body_close(mnfcgi_ctx_t *ctx)
+{
+    size_t n;
+    uint8_t psz;
+    off_t eod;
+
+    if (ctx->body < 0) {
+        return;
+    }
+
+    n = SEOD(&ctx->out) - ctx->body - MNFCGI_HEADER_LEN;
+    if (n == 0) {
+        /* an empty record would end the stream */
+        SEOD(&ctx->out) = ctx->body;
+    } else {
+        psz = (n % 8) ? 8 - n % 8 : 0;
+        eod = SEOD(&ctx->out);
+        SEOD(&ctx->out) = ctx->body;
+        mnfcgi_render_header(&ctx->out,
+                             MNFCGI_STDOUT,
+                             ctx->body_rid,
+                             n,
+                             psz);
+        SEOD(&ctx->out) = eod;
+        if (psz > 0) {
+            (void)bytestream_cat(&ctx->out, psz, _padding);
+        }
+    }
+    ctx->body = -1;
+}
+
+
+static int
+mnfcgi_ctx_writev(mnfcgi_ctx_t *ctx, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t n;
+
+        if ((n = writev(ctx->fd, iov, iovcnt)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (mnthr_wait_for_write(ctx->fd) != 0) {
+                    return -1;
+                }
+                continue;
+            }
+            return -1;
+        }
+
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Move sz bytes of fd at off to the socket kernel-side where possible.
+ */
+static int
+mnfcgi_ctx_sendfile(mnfcgi_ctx_t *ctx, int fd, off_t off, size_t sz)
+{
+    while (sz > 0) {
+        ssize_t n;
+
+#if defined(__linux__)
+        n = sendfile(ctx->fd, fd, &off, sz);
+#elif defined(__FreeBSD__)
+        {
+            off_t sbytes;
+
+            sbytes = 0;
+            if (sendfile(fd, ctx->fd, off, sz, NULL, &sbytes, 0) != 0 &&
+                sbytes == 0) {
+                n = -1;
+            } else {
+                n = sbytes;
+                off += sbytes;
+            }
+        }
+#else
+        {
+            char buf[4096];
+            struct iovec iov;
+
+            if ((n = pread(fd, buf,
+                           sz > sizeof(buf) ? sizeof(buf) : sz,
+                           off)) > 0) {
+                iov.iov_base = buf;
+                iov.iov_len = n;
+                if (mnfcgi_ctx_writev(ctx, &iov, 1) != 0) {
+                    return -1;
+                }
+                off += n;
+            }
+        }
+#endif
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (mnthr_wait_for_write(ctx->fd) != 0) {
+                    return -1;
+                }
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            /* the file is shorter than promised in the record header */
+            return -1;
+        }
+        sz -= n;
+    }
+    return 0;
+}
+
+
+/*
+ * Send the pending output.
+ */
+static int
+mnfcgi_ctx_produce(mnfcgi_ctx_t *ctx)
+{
+#define MNFCGI_CTX_WRITEV_NIOV 64
+    struct iovec iov[MNFCGI_CTX_WRITEV_NIOV];
+    size_t i;
+    int iovcnt;
+
+    mnfcgi_ctx_body_close(ctx);
+
+    if (ctx->niov == 0) {
+        return bytestream_produce_data(&ctx->out, ctx->fp);
+    }
+
+    mnfcgi_ctx_iov_cut(ctx);
+
+    for (i = 0, iovcnt = 0; i < ctx->niov; ++i) {
+        mnfcgi_iov_t *v;
+
+        v = &ctx->iov[i];
+        if (v->fd != -1) {
+            if (iovcnt > 0) {
+                if (MNUNLIKELY(mnfcgi_ctx_writev(ctx, iov, iovcnt) != 0)) {
+                    return -1;
+                }
+                iovcnt = 0;
+            }
+            if (MNUNLIKELY(mnfcgi_ctx_sendfile(ctx,
+                                               v->fd,
+                                               v->off,
+                                               v->sz) != 0)) {
+                return -1;
+            }
+            continue;
+        }
+        iov[iovcnt].iov_base = v->data != NULL ?
+            (void *)v->data : SDATA(&ctx->out, v->off);
+        iov[iovcnt].iov_len = v->sz;
+        if (++iovcnt == MNFCGI_CTX_WRITEV_NIOV) {
+            if (MNUNLIKELY(mnfcgi_ctx_writev(ctx, iov, iovcnt) != 0)) {
+                return -1;
+            }
+            iovcnt = 0;
+        }
+    }
+    if (iovcnt > 0) {
+        if (MNUNLIKELY(mnfcgi_ctx_writev(ctx, iov, iovcnt) != 0)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Wait until no other thread is sending ctx->out.  Anything that renders
+ * into ctx->out has to call this first, since ctx->out may be reallocated
+ * under a pending writev().
+ */
+static int
+mnfcgi_ctx_out_wait(mnfcgi_ctx_t *ctx)
+{
+    while (ctx->outbusy) {
+        if (MNUNLIKELY(mnthr_cond_wait(&ctx->outcond) != 0)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Send and discard the pending output on behalf of the calling thread.
+ */
+static int
+mnfcgi_ctx_flush(mnfcgi_ctx_t *ctx)
+{
+    int res;
+
+    if (MNUNLIKELY(mnfcgi_ctx_out_wait(ctx) != 0)) {
+        return -1;
+    }
+    res = 0;
+    if (SAVAIL(&ctx->out) > 0) {
+        ctx->outbusy = true;
+        res = mnfcgi_ctx_produce(ctx);
+        ctx->outbusy = false;
+    }
+    mnfcgi_ctx_out_reset(ctx);
+    mnthr_cond_signal_all(&ctx->outcond);
+    return res;
+}
+
+
+void
+mnfcgi_ctx_send_interrupt(mnfcgi_request_t *req)
+{
+    if (req->thread != NULL) {
+        mnthr_set_interrupt(req->thread);
+    } else if (req->ctx->thread != NULL) {
+        mnthr_set_interrupt(req->ctx->thread);
+    }
+}
+
+/*
+ * Fast CGI protocol handler
+ */
+static int
+mnfcgi_render_end_request(mnfcgi_ctx_t *ctx,
+                          mnfcgi_record_t *rec,
+                          uint8_t proto_status,
+                          uint32_t app_status)
+{
+    int res;
+    mnfcgi_record_t *response;
+
+    if (MNUNLIKELY(mnfcgi_ctx_out_wait(ctx) != 0)) {
+        return MNFCGI_IO_ERROR;
+    }
+    res = 0;
+    mnfcgi_ctx_body_close(ctx);
+
+    if (MNUNLIKELY(
+            (response =
+             mnfcgi_record_pool_get(&ctx->pool,
+                                    MNFCGI_END_REQUEST)) == NULL)) {
+        res = MNFCGI_RENDER_END_REQUEST + 1;
+        goto end;
+    }
+    //CTRACE("rid=%hd", rec->header.rid);
+    response->header.rid = rec->header.rid;
+    response->end_request.proto_status = proto_status;
+    response->end_request.app_status = app_status;
+
+    if (MNUNLIKELY((res = mnfcgi_render(&ctx->out, response, NULL)) != 0)) {
+        goto end;
+    }
+
+end:
+    mnfcgi_record_destroy(&response);
+    return res;
+}
+
+
+static int
+mnfcgi_render_empty_stdout(mnfcgi_ctx_t *ctx,
+                         mnfcgi_request_t *req)
+{
+    int res;
+    mnfcgi_record_t *response;
+
+    if (req->flags.complete) {
+        return MNFCGI_REQUEST_COMPLETED;
+    }
+    if (MNUNLIKELY(mnfcgi_ctx_out_wait(ctx) != 0)) {
+        return MNFCGI_IO_ERROR;
+    }
+
+    res = 0;
+    mnfcgi_ctx_body_close(ctx);
+    if (MNUNLIKELY(
+            (response =
+             mnfcgi_record_pool_get(&ctx->pool, MNFCGI_STDOUT)) == NULL)) {
+        res = MNFCGI_RENDER_EMPTY_STDOUT + 1;
+        goto end;
+    }
+    assert(req->begin_request != NULL);
+    //CTRACE("rid=%hd", req->begin_request->header.rid);
+    response->header.rid = req->begin_request->header.rid;
+
+    if (MNUNLIKELY((res = mnfcgi_render(&ctx->out, response, NULL)) != 0)) {
+        goto end;
+    }
+
+end:
+    mnfcgi_record_destroy(&response);
+    return res;
+
+}
+
+
+static int
+mnfcgi_abort_request(mnfcgi_request_t *req, int app_status)
+{
+    int res;
+    //mnfcgi_header_t *h;
+    //mnhash_item_t *hit;
+
+    //CTRACE("AAA");
+
+    //while ((h = STQUEUE_HEAD(&req->_stdout)) != NULL) {
+    //    mnfcgi_record_t *rec;
+
+    //    rec = (mnfcgi_record_t *)h;
+    //    mnfcgi_record_destroy(&rec);
+    //}
+
+    if (!req->flags.complete) {
+        /* end request */
+        if (mnfcgi_render_end_request(
+                req->ctx,
+                req->begin_request,
+                MNFCGI_REQUEST_COMPLETE,
+                app_status) != 0) {
+        }
+        /* nothing else is rendered for it while the flush is under way */
+        req->flags.complete = -1;
+
+        if (MNUNLIKELY(
+                (res = mnfcgi_ctx_flush(req->ctx)) != 0)) {
+            res = MNFCGI_IO_ERROR;
+        }
+    } else {
+        res = MNFCGI_REQUEST_COMPLETED;
+    }
+
+    return res;
+}
+
+
+int
+mnfcgi_render_stdout(mnfcgi_request_t *req,
+                     mnfcgi_renderer_t render,
+                     void *udata)
+{
+    int res;
+    mnfcgi_record_t *rec;
+
+    //CTRACE("BBB");
+    if (req->flags.complete) {
+        return MNFCGI_REQUEST_COMPLETED;
+    }
+    if (MNUNLIKELY(mnfcgi_ctx_out_wait(req->ctx) != 0)) {
+        return MNFCGI_IO_ERROR;
+    }
+
+    res = 0;
+    mnfcgi_ctx_body_close(req->ctx);
+    if (MNUNLIKELY(
+            (rec =
+             mnfcgi_record_pool_get(&req->ctx->pool,
+                                    MNFCGI_STDOUT)) == NULL)) {
+        res = MNFCGI_RENDER_STDOUT + 1;
+        goto end;
+    }
+    assert(req->begin_request != NULL);
+    //CTRACE("rid=%hd", req->begin_request->header.rid);
+    rec->header.rid = req->begin_request->header.rid;
+    rec->_stdout.render = render;
+    rec->_stdout.udata = udata;
+
+    if (MNUNLIKELY((res = mnfcgi_render(&req->ctx->out,
+                                  rec,
+                                  req)) != 0)) {
+        goto end;
+    }
+
+end:
+    mnfcgi_record_destroy(&rec);
+    return res;
+
+}
+
+
+static int
+mnfcgi_render_stdout_ref(mnfcgi_request_t *req,
+                         mnbytes_t *ref,
+                         const char *data,
+                         size_t sz)
+{
+    mnfcgi_ctx_t *ctx;
+
+    if (req->flags.complete) {
+        return MNFCGI_REQUEST_COMPLETED;
+    }
+
+    assert(req->begin_request != NULL);
+    ctx = req->ctx;
+    if (MNUNLIKELY(mnfcgi_ctx_out_wait(ctx) != 0)) {
+        return MNFCGI_IO_ERROR;
+    }
+    mnfcgi_ctx_body_close(ctx);
+
+    /* an empty record would end the stream */
+    while (sz > 0) {
+        size_t n;
+        uint8_t psz;
+
+        n = sz > MNFCGI_MAX_RECORD_PAYLOAD ? MNFCGI_MAX_RECORD_PAYLOAD : sz;
+        psz = (n % 8) ? 8 - n % 8 : 0;
+        mnfcgi_render_header(&ctx->out,
+                             MNFCGI_STDOUT,
+                             req->begin_request->header.rid,
+                             n,
+                             psz);
+        mnfcgi_ctx_iov_cut(ctx);
+        mnfcgi_ctx_iov_add(ctx, ref, data, 0, n);
+        if (psz > 0) {
+            mnfcgi_ctx_iov_add(ctx, NULL, _padding, 0, psz);
+        }
+        data += n;
+        sz -= n;
+    }
+
+    return 0;
+}
+
+
+int
+mnfcgi_render_stdout_bytes(mnfcgi_request_t *req, mnbytes_t *b)
+{
+    size_t sz;
+
+    sz = BSZ(b);
+    if (sz > 0 && BDATA(b)[sz - 1] == '\0') {
+        --sz;
+    }
+    return mnfcgi_render_stdout_ref(req, b, BCDATA(b), sz);
+}
+
+
+int
+mnfcgi_render_stdout_data(mnfcgi_request_t *req,
+                          const void *data,
+                          size_t sz)
+{
+    return mnfcgi_render_stdout_ref(req, NULL, data, sz);
+}
+
+
+int
+mnfcgi_render_stdout_fd(mnfcgi_request_t *req,
+                        int fd,
+                        off_t off,
+                        size_t sz)
+{
+    mnfcgi_ctx_t *ctx;
+
+    if (req->flags.complete) {
+        return MNFCGI_REQUEST_COMPLETED;
+    }
+
+    assert(req->begin_request != NULL);
+    assert(fd != -1);
+    ctx = req->ctx;
+    if (MNUNLIKELY(mnfcgi_ctx_out_wait(ctx) != 0)) {
+        return MNFCGI_IO_ERROR;
+    }
+    mnfcgi_ctx_body_close(ctx);
+
+    /* an empty record would end the stream */
+    while (sz > 0) {
+        size_t n;
+        uint8_t psz;
+
+        n = sz > MNFCGI_MAX_RECORD_PAYLOAD ? MNFCGI_MAX_RECORD_PAYLOAD : sz;
+        psz = (n % 8) ? 8 - n % 8 : 0;
+        mnfcgi_render_header(&ctx->out,
+                             MNFCGI_STDOUT,
+                             req->begin_request->header.rid,
+                             n,
+                             psz);
+        mnfcgi_ctx_iov_cut(ctx);
+        mnfcgi_ctx_iov_add_fd(ctx, fd, off, n);
+        if (psz > 0) {
+            mnfcgi_ctx_iov_add(ctx, NULL, _padding, 0, psz);
+        }
+        off += n;
+        sz -= n;
+    }
+
+    return 0;
+}
+
+
+int
+mnfcgi_write(mnfcgi_request_t *req, const void *data, size_t sz)
+{
+    mnfcgi_ctx_t *ctx;
+    const char *s;
+    uint16_t rid;
+
+    if (req->flags.complete) {
+        return MNFCGI_REQUEST_COMPLETED;
+    }
+
+    assert(req->begin_request != NULL);
+    ctx = req->ctx;
+    rid = req->begin_request->header.rid;
+
+    s = data;
+    while (sz > 0) {
+        size_t n;
+
+        if (MNUNLIKELY(mnfcgi_ctx_out_wait(ctx) != 0)) {
+            return MNFCGI_IO_ERROR;
+        }
+        if (MNUNLIKELY(req->flags.complete)) {
+            return MNFCGI_REQUEST_COMPLETED;
+        }
+        if (ctx->body >= 0 && ctx->body_rid != rid) {
+            /* another request wrote while we were flushing */
+            mnfcgi_ctx_body_close(ctx);
+        }
+        if (ctx->body < 0) {
+            ctx->body = SEOD(&ctx->out);
+            ctx->body_rid = rid;
+            /* placeholder */
+            mnfcgi_render_header(&ctx->out, MNFCGI_STDOUT, rid, 0, 0);
+        }
+
+        n = MNFCGI_MAX_RECORD_PAYLOAD -
+            (SEOD(&ctx->out) - ctx->body - MNFCGI_HEADER_LEN);
+        if (n > sz) {
+            n = sz;
+        }
+        if (MNUNLIKELY(bytestream_cat(&ctx->out, n, s) < 0)) {
+            return MNFCGI_IO_ERROR;
+        }
+        s += n;
+        sz -= n;
+
+        if ((SEOD(&ctx->out) - ctx->body - MNFCGI_HEADER_LEN) ==
+                MNFCGI_MAX_RECORD_PAYLOAD) {
+            mnfcgi_ctx_body_close(ctx);
+        }
+
+        if (ctx->config->stdout_watermark > 0 &&
+            (size_t)SEOD(&ctx->out) >= ctx->config->stdout_watermark) {
+            int res;
+
+            if ((res = mnfcgi_flush_out(req)) != 0) {
+                return res;
+            }
+        }
+    }
+
+    return 0;
 }
 
 
-void
-mnfcgi_ctx_send_interrupt(mnfcgi_request_t *req)
+int PRINTFLIKE(2, 3)
+mnfcgi_writef(mnfcgi_request_t *req, const char *fmt, ...)
 {
-    if (req->ctx->thread != NULL) {
-        mnthr_set_interrupt(req->ctx->thread);
+    int res;
+    char buf[256], *s;
+    va_list ap;
+    int sz;
+
+    va_start(ap, fmt);
+    sz = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (MNUNLIKELY(sz < 0)) {
+        FAIL("vsnprintf");
+    }
+
+    if ((size_t)sz < sizeof(buf)) {
+        return mnfcgi_write(req, buf, sz);
+    }
+
+    if (MNUNLIKELY((s = malloc(sz + 1)) == NULL)) {
+        FAIL("malloc");
     }
+    va_start(ap, fmt);
+    (void)vsnprintf(s, sz + 1, fmt, ap);
+    va_end(ap);
+    res = mnfcgi_write(req, s, sz);
+    free(s);
+    return res;
 }
 
+
 /*
- * Fast CGI protocol handler
+ * Reply FCGI_END_REQUEST to a record that refers to an unknown request.
+ * The rest of the streams of a request that has been ended already, for
+ * example rejected with FCGI_OVERLOADED, is dropped.
  */
 static int
-mnfcgi_render_end_request(mnfcgi_ctx_t *ctx,
-                          mnfcgi_record_t *rec,
-                          uint8_t proto_status,
-                          uint32_t app_status)
+mnfcgi_ctx_no_such_request(mnfcgi_ctx_t *ctx, mnfcgi_record_t *rec)
 {
-    int res;
-    mnfcgi_record_t *response;
-
-    res = 0;
+    if (rec->header.type == MNFCGI_PARAMS ||
+        rec->header.type == MNFCGI_STDIN ||
+        rec->header.type == MNFCGI_DATA) {
+        mnfcgi_record_destroy(&rec);
+        return 0;
+    }
 
-    if (MNUNLIKELY(
-            (response =
-             mnfcgi_record_new(MNFCGI_END_REQUEST)) == NULL)) {
-        res = MNFCGI_RENDER_END_REQUEST + 1;
-        goto end;
+    CTRACE("no such request %hd", rec->header.rid);
+    if (mnfcgi_render_end_request(ctx,
+                                  rec,
+                                  MNFCGI_REQUEST_COMPLETE,
+                                  0) != 0) {
+        return -1;
     }
-    //CTRACE("rid=%hd", rec->header.rid);
-    response->header.rid = rec->header.rid;
-    response->end_request.proto_status = proto_status;
-    response->end_request.app_status = app_status;
+    mnfcgi_record_destroy(&rec);
+    return 0;
+}
 
-    if (MNUNLIKELY((res = mnfcgi_render(&ctx->out, response, NULL)) != 0)) {
-        goto end;
+
+/*
+ * Admission control: more connections than max_conn are served, or
+ * max_req requests are in flight, in this process.
+ */
+static bool
+mnfcgi_ctx_overloaded(mnfcgi_ctx_t *ctx)
+{
+    mnfcgi_config_t *config;
+
+    config = ctx->config;
+    if (MNFCGI_ATOMIC_LOAD(&config->stats.nthreads) > config->max_conn) {
+        return true;
+    }
+    if (config->max_req > 0 &&
+        MNFCGI_ATOMIC_LOAD(&config->stats.nrequests) >=
+            (size_t)config->max_req) {
+        return true;
     }
+    return false;
+}
 
-end:
-    mnfcgi_record_destroy(&response);
-    return res;
+
+static off_t
+mnfcgi_request_body_pos(mnfcgi_request_t *req)
+{
+    return req->flags.body ? SPOS(&req->body) : 0;
 }
 
 
-static int
-mnfcgi_render_empty_stdout(mnfcgi_ctx_t *ctx,
-                         mnfcgi_request_t *req)
+/*
+ * Copy the payload of an FCGI_STDIN record to the end of req->body, and
+ * point the record at the copy.
+ */
+static void
+mnfcgi_request_body_append(mnfcgi_request_t *req, mnfcgi_record_t *rec)
 {
-    int res;
-    mnfcgi_record_t *response;
+    mnfcgi_ctx_t *ctx;
+    off_t start;
+
+    ctx = req->ctx;
+    if (rec->header.rsz == 0) {
+        req->flags.stdin_end = -1;
+        start = req->flags.body ? SEOD(&req->body) : 0;
+        rec->_stdin.br.start = start;
+        rec->_stdin.br.end = start;
+        return;
+    }
 
-    if (req->flags.complete) {
-        return MNFCGI_REQUEST_COMPLETED;
+    if (!req->flags.body) {
+        bytestream_init(&req->body, MNFCGI_DEFAULT_BYTESTREAM_BUFSZ);
+        req->flags.body = -1;
+    }
+    start = SEOD(&req->body);
+    if (MNUNLIKELY(bytestream_cat(&req->body,
+                                  rec->header.rsz,
+                                  SDATA(&ctx->in,
+                                        rec->_stdin.br.start)) < 0)) {
+        FAIL("bytestream_cat");
     }
+    rec->_stdin.br.start = start;
+    rec->_stdin.br.end = SEOD(&req->body);
+}
 
-    res = 0;
-    if (MNUNLIKELY(
-            (response =
-             mnfcgi_record_new(MNFCGI_STDOUT)) == NULL)) {
-        res = MNFCGI_RENDER_EMPTY_STDOUT + 1;
+
+/*
+ * Called after the read position of req->body has advanced.  Reclaim the
+ * consumed space once it is at least as big as the unconsumed data, and
+ * let the connection thread go on reading.
+ */
+static void
+mnfcgi_request_body_consumed(mnfcgi_request_t *req)
+{
+    off_t shift;
+    mnfcgi_header_t *h;
+
+    shift = SPOS(&req->body);
+    if (shift == 0 || shift < SAVAIL(&req->body)) {
         goto end;
     }
-    assert(req->begin_request != NULL);
-    //CTRACE("rid=%hd", req->begin_request->header.rid);
-    response->header.rid = req->begin_request->header.rid;
 
-    if (MNUNLIKELY((res = mnfcgi_render(&ctx->out, response, NULL)) != 0)) {
-        goto end;
+    if (SAVAIL(&req->body) == 0) {
+        bytestream_rewind(&req->body);
+    } else {
+        off_t avail;
+
+        avail = SAVAIL(&req->body);
+        memmove(SDATA(&req->body, 0), SPDATA(&req->body), avail);
+        SPOS(&req->body) = 0;
+        SEOD(&req->body) = avail;
     }
 
-end:
-    mnfcgi_record_destroy(&response);
-    return res;
+    /* records that have been read end up with negative ranges */
+    for (h = STQUEUE_HEAD(&req->pending);
+         h != NULL;
+         h = STQUEUE_NEXT(link, h)) {
+        mnfcgi_record_t *rec;
+
+        rec = (mnfcgi_record_t *)h;
+        if (rec->header.type == MNFCGI_STDIN) {
+            rec->_stdin.br.start -= shift;
+            rec->_stdin.br.end -= shift;
+        }
+    }
+    if (req->stdin_cur != NULL) {
+        req->stdin_cur->_stdin.br.start -= shift;
+        req->stdin_cur->_stdin.br.end -= shift;
+    }
 
+end:
+    mnthr_cond_signal_all(&req->ctx->bodycond);
 }
 
 
+/*
+ * Spilled bodies.
+ */
 static int
-mnfcgi_abort_request(mnfcgi_request_t *req, int app_status)
+mnfcgi_spill_open(mnfcgi_config_t *config)
 {
-    int res;
-    //mnfcgi_header_t *h;
-    //mnhash_item_t *hit;
+    int fd;
+    const char *dir;
+    char path[PATH_MAX];
 
-    //CTRACE("AAA");
+#if defined(MFD_CLOEXEC)
+    if (config->stdin_spill_dir == NULL) {
+        if ((fd = memfd_create("mnfcgi-body", MFD_CLOEXEC)) != -1) {
+            return fd;
+        }
+        CTRACE("memfd_create: %s", strerror(errno));
+    }
+#endif
 
-    //while ((h = STQUEUE_HEAD(&req->_stdout)) != NULL) {
-    //    mnfcgi_record_t *rec;
+    if (config->stdin_spill_dir != NULL) {
+        dir = BCDATA(config->stdin_spill_dir);
+    } else if ((dir = getenv("TMPDIR")) == NULL) {
+        dir = "/tmp";
+    }
+    (void)snprintf(path, sizeof(path), "%s/mnfcgi-body.XXXXXX", dir);
+    if ((fd = mkstemp(path)) == -1) {
+        CTRACE("mkstemp %s: %s", path, strerror(errno));
+        return -1;
+    }
+    (void)unlink(path);
+    (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
 
-    //    rec = (mnfcgi_record_t *)h;
-    //    mnfcgi_record_destroy(&rec);
-    //}
 
-    if (!req->flags.complete) {
-        /* end request */
-        if (mnfcgi_render_end_request(
-                req->ctx,
-                req->begin_request,
-                MNFCGI_REQUEST_COMPLETE,
-                app_status) != 0) {
-        }
+static int
+mnfcgi_request_spill_write(mnfcgi_request_t *req, const char *data, size_t sz)
+{
+    while (sz > 0) {
+        ssize_t nwritten;
 
-        if (MNUNLIKELY(
-                (res = bytestream_produce_data(
-                    &req->ctx->out,
-                    req->ctx->fp)) != 0)) {
-            res = MNFCGI_IO_ERROR;
+        if ((nwritten = write(req->spill_fd, data, sz)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            CTRACE("write: %s", strerror(errno));
+            return -1;
         }
-    } else {
-        res = MNFCGI_REQUEST_COMPLETED;
+        data += nwritten;
+        sz -= nwritten;
+        req->spill_sz += nwritten;
     }
+    return 0;
+}
 
-    bytestream_rewind(&req->ctx->in);
-    bytestream_rewind(&req->ctx->out);
-    req->flags.complete = -1;
 
-    return res;
+/*
+ * Called once the params are known, before any of the body is consumed.
+ * Move what has been buffered so far to the file, the connection thread
+ * writes the rest straight to it.
+ */
+static int
+mnfcgi_request_spill_start(mnfcgi_request_t *req)
+{
+    const char *s;
+    size_t sz;
+    intmax_t len;
+
+    if (req->ctx->config->stdin_spill == 0 ||
+        (s = mnfcgi_request_cgi_data(req,
+                                     MNFCGI_CGI_CONTENT_LENGTH,
+                                     &sz)) == NULL) {
+        return 0;
+    }
+    len = strtoimax(s, NULL, 10);
+    if (len <= 0 || (uintmax_t)len <= req->ctx->config->stdin_spill) {
+        return 0;
+    }
+
+    if ((req->spill_fd = mnfcgi_spill_open(req->ctx->config)) == -1) {
+        return -1;
+    }
+    if (req->flags.body && SAVAIL(&req->body) > 0) {
+        if (mnfcgi_request_spill_write(req,
+                                       SPDATA(&req->body),
+                                       SAVAIL(&req->body)) != 0) {
+            return -1;
+        }
+        SPOS(&req->body) = SEOD(&req->body);
+        mnfcgi_request_body_consumed(req);
+    }
+    return 0;
 }
 
 
 int
-mnfcgi_render_stdout(mnfcgi_request_t *req,
-                     mnfcgi_renderer_t render,
-                     void *udata)
+mnfcgi_request_body_fd(mnfcgi_request_t *req, size_t *sz)
 {
-    int res;
-    mnfcgi_record_t *rec;
-
-    //CTRACE("BBB");
-    if (req->flags.complete) {
-        return MNFCGI_REQUEST_COMPLETED;
+    if (req->spill_fd == -1 || !req->flags.stdin_end) {
+        return -1;
     }
-
-    res = 0;
-    if (MNUNLIKELY(
-            (rec =
-             mnfcgi_record_new(MNFCGI_STDOUT)) == NULL)) {
-        res = MNFCGI_RENDER_STDOUT + 1;
-        goto end;
+    if (sz != NULL) {
+        *sz = req->spill_sz;
     }
-    assert(req->begin_request != NULL);
-    //CTRACE("rid=%hd", req->begin_request->header.rid);
-    rec->header.rid = req->begin_request->header.rid;
-    rec->_stdout.render = render;
-    rec->_stdout.udata = udata;
+    return req->spill_fd;
+}
 
-    if (MNUNLIKELY((res = mnfcgi_render(&req->ctx->out,
-                                  rec,
-                                  req)) != 0)) {
-        goto end;
+
+const void *
+mnfcgi_request_body_map(mnfcgi_request_t *req, size_t *sz)
+{
+    if (req->spill_fd == -1 ||
+        !req->flags.stdin_end ||
+        req->spill_sz == 0) {
+        return NULL;
+    }
+    if (req->spill_map == NULL) {
+        void *map;
+
+        if ((map = mmap(NULL,
+                        req->spill_sz,
+                        PROT_READ,
+                        MAP_SHARED,
+                        req->spill_fd,
+                        0)) == MAP_FAILED) {
+            CTRACE("mmap: %s", strerror(errno));
+            return NULL;
+        }
+        req->spill_map = map;
+    }
+    if (sz != NULL) {
+        *sz = req->spill_sz;
     }
+    return req->spill_map;
+}
 
-end:
-    mnfcgi_record_destroy(&rec);
-    return res;
 
+ssize_t
+mnfcgi_request_read(mnfcgi_request_t *req, void *buf, size_t sz)
+{
+    size_t n;
+
+    while (!req->flags.body || SAVAIL(&req->body) == 0) {
+        if (req->flags.stdin_end) {
+            ssize_t nread;
+
+            if (req->spill_fd == -1) {
+                return 0;
+            }
+            if ((nread = pread(req->spill_fd,
+                               buf,
+                               sz,
+                               req->spill_rpos)) == -1) {
+                CTRACE("pread: %s", strerror(errno));
+                return MNFCGI_IO_ERROR;
+            }
+            req->spill_rpos += nread;
+            return nread;
+        }
+        if (req->flags.complete) {
+            return MNFCGI_REQUEST_COMPLETED;
+        }
+        if (MNUNLIKELY(mnthr_cond_wait(&req->cond) != 0)) {
+            return MNFCGI_IO_ERROR;
+        }
+    }
+
+    n = SAVAIL(&req->body);
+    if (n > sz) {
+        n = sz;
+    }
+    memcpy(buf, SPDATA(&req->body), n);
+    SADVANCEPOS(&req->body, n);
+    mnfcgi_request_body_consumed(req);
+    return n;
 }
 
 
+/*
+ * Backpressure: while the request rid has stdin_watermark bytes of body
+ * that its thread has not consumed, don't read any more of the
+ * connection.  The request may be gone by the time the wait is over.
+ */
 static void
-_mnfcgi_handle_socket(mnfcgi_ctx_t *ctx)
+mnfcgi_ctx_body_wait(mnfcgi_ctx_t *ctx, uint16_t rid)
 {
-#ifdef TRRET_DEBUG
-    CTRACE("started serving request at fd %d", ctx->fd);
-#endif
-    while (true) {
-        mnfcgi_record_t *rec;
-        mnhash_item_t *hit;
-        mnhash_iter_t it;
-        mnfcgi_request_t *req;
+    mnfcgi_request_t *req;
 
-        if (MNUNLIKELY((rec = mnfcgi_parse(&ctx->in, ctx->fp)) == NULL)) {
-            goto err;
+    if (ctx->config->stdin_watermark == 0) {
+        return;
+    }
+
+    while ((req = mnfcgi_ctx_request_get(ctx, rid)) != NULL) {
+        if (req->flags.complete ||
+            !req->flags.body ||
+            (size_t)SAVAIL(&req->body) < ctx->config->stdin_watermark) {
+            break;
+        }
+        if (MNUNLIKELY(mnthr_cond_wait(&ctx->bodycond) != 0)) {
+            /* interrupted, go on reading */
+            break;
         }
+    }
+}
 
-        //CTRACE("handling type %s", MNFCGI_TYPE_STR(rec->header.type));
 
-        switch (rec->header.type) {
-        case MNFCGI_BEGIN_REQUEST:
-            {
-                mnfcgi_begin_request_t *tmp;
+/*
+ * The thread of a request.  It runs the application parsers on the
+ * records that the connection thread passes to it, until the request is
+ * complete, and then destroys the request.
+ */
+static int
+mnfcgi_request_run(UNUSED int argc, void **argv)
+{
+    mnfcgi_ctx_t *ctx;
+    mnfcgi_request_t *req;
 
-                tmp = (mnfcgi_begin_request_t *)rec;
+    ctx = argv[0];
+    req = argv[1];
 
-                if (tmp->role != MNFCGI_RESPONDER) {
-                    CTRACE("role not supported %hd", tmp->role);
-                    if (MNUNLIKELY(mnfcgi_render_end_request(ctx,
-                                                  rec,
-                                                  MNFCGI_UNKNOWN_ROLE,
-                                                  0) != 0)) {
-                        goto err;
-                    }
-                    if (MNUNLIKELY(
-                        bytestream_produce_data(&ctx->out, ctx->fp) != 0)) {
-                        goto err;
-                    }
-                    mnfcgi_record_destroy(&rec);
+    if (ctx->config->begin_request_parse != NULL) {
+        ssize_t nparsed;
 
-                } else {
-                    if (MNLIKELY((hit = hash_get_item(&ctx->requests,
-                            (void *)(uintptr_t)rec->header.rid)) == NULL)) {
-                        req = mnfcgi_request_new();
-                        req->ctx = ctx;
-                        req->begin_request = rec;
-
-                        if (ctx->config->begin_request_parse != NULL) {
-                            ssize_t nparsed;
-
-                            if (MNUNLIKELY(
-                                    (nparsed =
-                                     ctx->config->begin_request_parse(
-                                        rec, &ctx->in, req)) < 0)) {
-                                CTRACE("user parser returned %ld", nparsed);
-
-                                (void)mnfcgi_abort_request(
-                                        req, (uint32_t)(0 - nparsed));
-
-                                mnfcgi_request_destroy(&req);
-
-                                if (MNUNLIKELY(
-                                    bytestream_produce_data(&ctx->out,
-                                                            ctx->fp) != 0)) {
-                                    goto err;
-                                }
-                                /* cannot pass down, request is destroyed */
-                                continue;
-                            }
-                        }
-
-                        if (!req->flags.complete) {
-                            hash_set_item(&ctx->requests,
-                                          (void *)(uintptr_t)rec->header.rid,
-                                          req);
-                        } else {
-                            mnfcgi_request_destroy(&req);
-                        }
-
-                    } else {
-                        CTRACE("double request %hd", rec->header.rid);
-                        /*
-                         * XXX delete this request ?
-                         */
-                        if (mnfcgi_render_end_request(ctx,
-                                                      rec,
-                                                      MNFCGI_REQUEST_COMPLETE,
-                                                      0) != 0) {
-                            goto err;
-                        }
-                        if (MNUNLIKELY(
-                            bytestream_produce_data(&ctx->out, ctx->fp) != 0)) {
-                            goto err;
-                        }
-                        mnfcgi_record_destroy(&rec);
-                    }
-                }
-            }
-            break;
+        if (MNUNLIKELY(
+                (nparsed =
+                 ctx->config->begin_request_parse(
+                    req->begin_request, &ctx->in, req)) < 0)) {
+            CTRACE("user parser returned %ld", nparsed);
 
-        case MNFCGI_ABORT_REQUEST:
-            {
-                if (MNUNLIKELY((hit = hash_get_item(&ctx->requests,
-                        (void *)(uintptr_t)rec->header.rid)) == NULL)) {
-                    CTRACE("no such request %hd", rec->header.rid);
-                    if (mnfcgi_render_end_request(ctx,
-                                                  rec,
-                                                  MNFCGI_REQUEST_COMPLETE,
-                                                  0) != 0) {
-                        goto err;
-                    }
+            (void)mnfcgi_abort_request(req, (uint32_t)(0 - nparsed));
+        }
+    }
 
-                } else {
-                    req = hit->value;
+    while (!req->flags.complete) {
+        mnfcgi_header_t *h;
+        mnfcgi_record_t *rec;
+        mnfcgi_parser_t parse;
+
+        if ((h = STQUEUE_HEAD(&req->pending)) == NULL) {
+            /* interrupted or not, re-check the request */
+            (void)mnthr_cond_wait(&req->cond);
+            continue;
+        }
+        STQUEUE_DEQUEUE(&req->pending, link);
+        rec = (mnfcgi_record_t *)h;
 
+        switch (rec->header.type) {
+        case MNFCGI_PARAMS:
+            if (rec->header.rsz == 0 &&
+                req->param_table.buf == NULL) {
+                /* end of params stream */
+                mnfcgi_request_merge_params(req);
+                if (MNUNLIKELY(mnfcgi_request_spill_start(req) != 0)) {
                     (void)mnfcgi_abort_request(req, 0);
-                    hash_delete_pair(&ctx->requests, hit);
                 }
+            }
+            STQUEUE_ENQUEUE(&req->params, link, h);
+            parse = ctx->config->params_parse;
+            break;
 
-                if (MNUNLIKELY(
-                    bytestream_produce_data(&ctx->out,
-                                            ctx->fp) != 0)) {
-                    goto err;
-                }
+        case MNFCGI_STDIN:
+            if ((req->spill_fd != -1 && rec->header.rsz > 0) ||
+                rec->_stdin.br.start < mnfcgi_request_body_pos(req)) {
+                /* spilled, or taken by mnfcgi_request_read() */
                 mnfcgi_record_destroy(&rec);
+                continue;
             }
+            req->stdin_cur = rec;
+            parse = ctx->config->stdin_parse;
             break;
 
+        default:
+            assert(rec->header.type == MNFCGI_DATA);
+            STQUEUE_ENQUEUE(&req->data, link, h);
+            parse = ctx->config->data_parse;
+            break;
+        }
 
-        case MNFCGI_PARAMS:
-            {
-                if (MNUNLIKELY((hit = hash_get_item(&ctx->requests,
-                        (void *)(uintptr_t)rec->header.rid)) == NULL)) {
-                    CTRACE("no such request %hd", rec->header.rid);
-                    if (mnfcgi_render_end_request(ctx,
-                                                  rec,
-                                                  MNFCGI_REQUEST_COMPLETE,
-                                                  0) != 0) {
-                        goto err;
-                    }
-                    if (MNUNLIKELY(
-                        bytestream_produce_data(&ctx->out,
-                                                ctx->fp) != 0)) {
-                        goto err;
-                    }
-                    mnfcgi_record_destroy(&rec);
+        if (parse != NULL) {
+            ssize_t nparsed;
 
-                } else {
-                    mnfcgi_header_t *h;
-
-                    req = hit->value;
-                    h = (mnfcgi_header_t *)rec;
-                    STQUEUE_ENQUEUE(&req->params, link, h);
-
-                    if (ctx->config->params_parse != NULL) {
-                        ssize_t nparsed;
-                        if ((nparsed = ctx->config->params_parse(rec,
-                                                        &ctx->in,
-                                                        req)) < 0) {
-                            CTRACE("user parser returned %ld", nparsed);
-
-                            (void)mnfcgi_abort_request(
-                                    req, (uint32_t)(0 - nparsed));
-
-                            hash_delete_pair(&ctx->requests, hit);
-
-                            if (MNUNLIKELY(
-                                bytestream_produce_data(&ctx->out,
-                                                        ctx->fp) != 0)) {
-                                goto err;
-                            }
-                            /*
-                             * don't mnfcgi_record_destroy(), since it's
-                             * already in the queue
-                             */
-
-                            /* cannot pass down, request is destroyed */
-                            continue;
-                        }
-                    }
+            if ((nparsed = parse(rec,
+                                 rec->header.type == MNFCGI_STDIN ?
+                                    &req->body : &ctx->in,
+                                 req)) < 0) {
+                CTRACE("user parser returned %ld", nparsed);
 
-                    if (req->flags.complete) {
-                        hash_delete_pair(&ctx->requests, hit);
-                    }
-                }
+                (void)mnfcgi_abort_request(req, (uint32_t)(0 - nparsed));
             }
+        }
 
-            break;
-
-        case MNFCGI_STDIN:
-            {
-                if (MNUNLIKELY((hit = hash_get_item(&ctx->requests,
-                        (void *)(uintptr_t)
-                        rec->header.rid)) == NULL)) {
-                    CTRACE("no such request %hd", rec->header.rid);
-                    if (mnfcgi_render_end_request(ctx,
-                                                  rec,
-                                                  MNFCGI_REQUEST_COMPLETE,
-                                                  0) != 0) {
-                        goto err;
-                    }
-                    if (MNUNLIKELY(
-                        bytestream_produce_data(&ctx->out,
-                                                ctx->fp) != 0)) {
-                        goto err;
-                    }
-                    mnfcgi_record_destroy(&rec);
+        if (rec->header.type == MNFCGI_STDIN) {
+            /* the record is consumed once parsed */
+            req->stdin_cur = NULL;
+            if (req->flags.body) {
+                if (SPOS(&req->body) < rec->_stdin.br.end) {
+                    SPOS(&req->body) = rec->_stdin.br.end;
+                }
+                mnfcgi_request_body_consumed(req);
+            }
+            mnfcgi_record_destroy(&rec);
+        }
+    }
 
-                } else {
-                    mnfcgi_header_t *h;
+    mnfcgi_ctx_request_del(ctx, req->begin_request->header.rid, req);
+    mnfcgi_request_destroy(&req);
 
-                    req = hit->value;
-                    h = (mnfcgi_header_t *)rec;
-                    STQUEUE_ENQUEUE(&req->_stdin, link, h);
+    --ctx->nreqthreads;
+    mnthr_cond_signal_all(&ctx->reqdone);
+    mnthr_cond_signal_all(&ctx->bodycond);
+    return 0;
+}
 
-                    if (ctx->config->stdin_parse != NULL) {
-                        ssize_t nparsed;
-                        if ((nparsed = ctx->config->stdin_parse(rec,
-                                                        &ctx->in,
-                                                        req)) < 0) {
-                            CTRACE("user parser returned %ld", nparsed);
 
-                            (void)mnfcgi_abort_request(
-                                    req, (uint32_t)(0 - nparsed));
+/*
+ * Handle one record.  Each request runs in a thread of its own, so that a
+ * slow handler does not hold up the other requests multiplexed on the
+ * connection.  Replies that are not produced by the application are left
+ * in ctx->out, and are sent once all buffered records are handled.  Return
+ * non-zero if the connection cannot go on.
+ */
+static int
+mnfcgi_ctx_dispatch(mnfcgi_ctx_t *ctx, mnfcgi_record_t *rec)
+{
+    mnfcgi_request_t *req;
 
-                            hash_delete_pair(&ctx->requests, hit);
+    //CTRACE("handling type %s", MNFCGI_TYPE_STR(rec->header.type));
 
-                            /*
-                             * don't mnfcgi_record_destroy(), since it's
-                             * already in the queue
-                             */
-                        }
-                    }
+    if (MNUNLIKELY(mnfcgi_ctx_out_wait(ctx) != 0)) {
+        return -1;
+    }
+    /* a request thread may have left a body record open */
+    mnfcgi_ctx_body_close(ctx);
+
+    switch (rec->header.type) {
+    case MNFCGI_BEGIN_REQUEST:
+        {
+            mnfcgi_begin_request_t *tmp;
+
+            tmp = (mnfcgi_begin_request_t *)rec;
+
+            if (tmp->role != MNFCGI_RESPONDER) {
+                CTRACE("role not supported %hd", tmp->role);
+                if (MNUNLIKELY(mnfcgi_render_end_request(ctx,
+                                              rec,
+                                              MNFCGI_UNKNOWN_ROLE,
+                                              0) != 0)) {
+                    return -1;
+                }
+                mnfcgi_record_destroy(&rec);
 
-                    if (req->flags.complete) {
-                        hash_delete_pair(&ctx->requests, hit);
-                    }
+            } else if (MNUNLIKELY(mnfcgi_ctx_overloaded(ctx))) {
+                /* let the web server try elsewhere right away */
+                (void)MNFCGI_ATOMIC_ADD(&ctx->config->stats.noverloaded, 1);
+                if (MNUNLIKELY(mnfcgi_render_end_request(ctx,
+                                              rec,
+                                              MNFCGI_OVERLOADED,
+                                              0) != 0)) {
+                    return -1;
                 }
-            }
-            break;
+                mnfcgi_record_destroy(&rec);
 
-        case MNFCGI_DATA:
-            {
-                if (MNUNLIKELY((hit = hash_get_item(&ctx->requests,
-                        (void *)(uintptr_t)
-                        rec->header.rid)) == NULL)) {
-                    CTRACE("no such request %hd", rec->header.rid);
+            } else {
+                req = mnfcgi_ctx_request_get(ctx, rec->header.rid);
+                if (MNLIKELY(req == NULL || req->flags.complete)) {
+                    /* the thread of an old one is about to exit */
+                    req = mnfcgi_request_new(ctx);
+                    req->begin_request = rec;
+                    mnfcgi_ctx_request_set(ctx, rec->header.rid, req);
+                    ++ctx->nreqthreads;
+                    req->thread = MNTHR_SPAWN(NULL,
+                                              mnfcgi_request_run,
+                                              ctx,
+                                              req);
+                    mnthr_set_name(req->thread,
+                                   "sock#%d/req#%hd",
+                                   ctx->fd,
+                                   rec->header.rid);
+
+                } else {
+                    CTRACE("double request %hd", rec->header.rid);
+                    /*
+                     * XXX delete this request ?
+                     */
                     if (mnfcgi_render_end_request(ctx,
                                                   rec,
                                                   MNFCGI_REQUEST_COMPLETE,
                                                   0) != 0) {
-                        goto err;
-                    }
-                    if (MNUNLIKELY(
-                        bytestream_produce_data(&ctx->out,
-                                                ctx->fp) != 0)) {
-                        goto err;
+                        return -1;
                     }
                     mnfcgi_record_destroy(&rec);
+                }
+            }
+        }
+        break;
 
-                } else {
-                    mnfcgi_header_t *h;
-
-                    req = hit->value;
-                    h = (mnfcgi_header_t *)rec;
-                    STQUEUE_ENQUEUE(&req->data, link, h);
-
-                    if (ctx->config->data_parse != NULL) {
-                        ssize_t nparsed;
-                        if ((nparsed = ctx->config->data_parse(rec,
-                                                        &ctx->in,
-                                                        req)) < 0) {
-                            CTRACE("user parser returned %ld", nparsed);
-
-                            (void)mnfcgi_abort_request(
-                                    req, (uint32_t)(0 - nparsed));
-
-                            hash_delete_pair(&ctx->requests, hit);
-                            /*
-                             * don't mnfcgi_record_destroy(), since it's
-                             * already in the queue
-                             */
-                        }
-                    }
+    case MNFCGI_ABORT_REQUEST:
+        {
+            if (MNUNLIKELY((req = mnfcgi_ctx_request_get(
+                        ctx, rec->header.rid)) == NULL)) {
+                return mnfcgi_ctx_no_such_request(ctx, rec);
 
-                    if (req->flags.complete) {
-                        hash_delete_pair(&ctx->requests, hit);
-                    }
-                }
+            } else {
+                (void)mnfcgi_abort_request(req, 0);
+                /* its thread destroys it */
+                mnthr_cond_signal_one(&req->cond);
             }
-            break;
 
-        case MNFCGI_GET_VALUES:
-            {
-                mnfcgi_get_values_t *tmp;
-                mnbytes_t *value;
-
-                tmp = (mnfcgi_get_values_t *)rec;
-                if ((hit = hash_get_item(&tmp->values,
-                                         &_MNFCGI_MAX_CONNS)) != NULL) {
-                    value = bytes_printf("%d", ctx->config->max_conn);
-                    hit->value = value;
-                    BYTES_INCREF(value);
+            mnfcgi_record_destroy(&rec);
+        }
+        break;
+
+
+    case MNFCGI_PARAMS:
+    case MNFCGI_STDIN:
+    case MNFCGI_DATA:
+        {
+            if (MNUNLIKELY((req = mnfcgi_ctx_request_get(
+                        ctx, rec->header.rid)) == NULL)) {
+                return mnfcgi_ctx_no_such_request(ctx, rec);
+
+            } else {
+                uint16_t rid;
+                bool isstdin;
+
+                if (req->flags.complete) {
+                    mnfcgi_record_destroy(&rec);
+                    break;
                 }
-                if ((hit = hash_get_item(&tmp->values,
-                                         &_MNFCGI_MAX_REQS)) != NULL) {
-                    value = bytes_printf("%d", ctx->config->max_req);
-                    hit->value = value;
-                    BYTES_INCREF(value);
+                rid = rec->header.rid;
+                isstdin = (rec->header.type == MNFCGI_STDIN);
+                if (isstdin &&
+                    req->spill_fd != -1 &&
+                    rec->header.rsz > 0) {
+                    if (MNUNLIKELY(mnfcgi_request_spill_write(
+                                req,
+                                SDATA(&ctx->in, rec->_stdin.br.start),
+                                rec->header.rsz) != 0)) {
+                        (void)mnfcgi_abort_request(req, 0);
+                        mnthr_cond_signal_one(&req->cond);
+                    }
+                    mnfcgi_record_destroy(&rec);
+                    break;
                 }
-                if ((hit = hash_get_item(&tmp->values,
-                                         &_MNFCGI_MPXS_CONNS)) != NULL) {
-                    value = bytes_new_from_str("1");
-                    hit->value = value;
-                    BYTES_INCREF(value);
+                if (isstdin) {
+                    mnfcgi_request_body_append(req, rec);
                 }
-                rec->header.type = MNFCGI_GET_VALUES_RESULT;
-                if (MNUNLIKELY(
-                        mnfcgi_render(&ctx->out, rec, NULL) != 0)) {
-                    goto err;
+                STQUEUE_ENQUEUE(&req->pending,
+                                link,
+                                (mnfcgi_header_t *)rec);
+                if (mnfcgi_record_pins_in(rec)) {
+                    ++ctx->npinned;
                 }
+                mnthr_cond_signal_one(&req->cond);
 
-                mnfcgi_record_destroy(&rec);
+                if (isstdin) {
+                    mnfcgi_ctx_body_wait(ctx, rid);
+                }
             }
+        }
+        break;
 
-            break;
+    case MNFCGI_GET_VALUES:
+        {
+            mnfcgi_get_values_t *tmp;
+            mnhash_item_t *hit;
+            mnbytes_t *value;
+
+            tmp = (mnfcgi_get_values_t *)rec;
+            if ((hit = hash_get_item(&tmp->values,
+                                     &_MNFCGI_MAX_CONNS)) != NULL) {
+                value = bytes_printf("%d", ctx->config->max_conn);
+                hit->value = value;
+                BYTES_INCREF(value);
+            }
+            if ((hit = hash_get_item(&tmp->values,
+                                     &_MNFCGI_MAX_REQS)) != NULL) {
+                value = bytes_printf("%d", ctx->config->max_req);
+                hit->value = value;
+                BYTES_INCREF(value);
+            }
+            if ((hit = hash_get_item(&tmp->values,
+                                     &_MNFCGI_MPXS_CONNS)) != NULL) {
+                value = bytes_new_from_str("1");
+                hit->value = value;
+                BYTES_INCREF(value);
+            }
+            rec->header.type = MNFCGI_GET_VALUES_RESULT;
+            if (MNUNLIKELY(
+                    mnfcgi_render(&ctx->out, rec, NULL) != 0)) {
+                return -1;
+            }
 
-        default:
-            {
-                mnfcgi_record_t *response;
+            mnfcgi_record_destroy(&rec);
+        }
 
-                if (MNUNLIKELY(
-                        (response =
-                         mnfcgi_record_new(MNFCGI_UNKNOWN_TYPE)) == NULL)) {
-                    goto err;
-                }
+        break;
 
-                response->unknown_type.type = rec->header.type;
-                if (MNUNLIKELY(mnfcgi_render(&ctx->out,
-                                              response,
-                                              NULL) != 0)) {
-                    mnfcgi_record_destroy(&response);
-                    goto err;
-                }
+    default:
+        {
+            mnfcgi_record_t *response;
+
+            if (MNUNLIKELY(
+                    (response =
+                     mnfcgi_record_pool_get(
+                         &ctx->pool, MNFCGI_UNKNOWN_TYPE)) == NULL)) {
+                return -1;
+            }
 
+            response->unknown_type.type = rec->header.type;
+            if (MNUNLIKELY(mnfcgi_render(&ctx->out,
+                                          response,
+                                          NULL) != 0)) {
                 mnfcgi_record_destroy(&response);
-                if (MNUNLIKELY(
-                        bytestream_produce_data(&ctx->out, ctx->fp) != 0)) {
-                    goto err;
-                }
-                mnfcgi_record_destroy(&rec);
+                return -1;
             }
 
-            break;
+            mnfcgi_record_destroy(&response);
+            mnfcgi_record_destroy(&rec);
+        }
+
+        break;
+    }
+
+    return 0;
+}
+
+
+static void
+_mnfcgi_handle_socket(mnfcgi_ctx_t *ctx)
+{
+#ifdef TRRET_DEBUG
+    CTRACE("started serving request at fd %d", ctx->fd);
+#endif
+    while (true) {
+        mnfcgi_record_t *rec;
+
+        /*
+         * read until there is at least one complete record, then handle
+         * all complete records that came with it before reading again
+         */
+        if (MNUNLIKELY((rec = mnfcgi_parse(&ctx->in,
+                                           ctx->fp,
+                                           &ctx->pool)) == NULL)) {
+            goto err;
+        }
+
+        while (true) {
+            if (MNUNLIKELY(mnfcgi_ctx_dispatch(ctx, rec) != 0)) {
+                goto err;
+            }
+
+            if (mnfcgi_frame(&ctx->in) == 0) {
+                break;
+            }
+
+            if (MNUNLIKELY((rec = mnfcgi_parse(&ctx->in,
+                                               ctx->fp,
+                                               &ctx->pool)) == NULL)) {
+                goto err;
+            }
+        }
+        rec = NULL;
+
+        if (MNUNLIKELY(mnfcgi_ctx_flush(ctx) != 0)) {
+            goto err;
+        }
+
+        /*
+         * queued records of incomplete requests may still refer to ctx->in
+         */
+        if (ctx->npinned == 0) {
+            if (SAVAIL(&ctx->in) == 0) {
+                bytestream_rewind(&ctx->in);
+            } else if (SPOS(&ctx->in) > 0) {
+                off_t avail;
+
+                /* keep the head of a partial record */
+                avail = SAVAIL(&ctx->in);
+                memmove(SDATA(&ctx->in, 0), SPDATA(&ctx->in), avail);
+                SPOS(&ctx->in) = 0;
+                SEOD(&ctx->in) = avail;
+            }
         }
 
         continue;
 
 err:
-        bytestream_rewind(&ctx->in);
-        bytestream_rewind(&ctx->out);
         mnfcgi_record_destroy(&rec);
-        /* set requests complete */
-        for (hit = hash_first(&ctx->requests, &it);
-             hit != NULL;
-             hit = hash_next(&ctx->requests, &it)) {
-            req = hit->value;
-            req->flags.complete = -1;
+        /* set requests complete, and let their threads finish */
+        mnfcgi_ctx_requests_complete(ctx);
+        while (ctx->nreqthreads > 0) {
+            (void)mnthr_cond_wait(&ctx->reqdone);
         }
+        bytestream_rewind(&ctx->in);
+        mnfcgi_ctx_out_reset(ctx);
 
         break;
     }
@@ -1364,12 +3395,9 @@ mnfcgi_flush_out(mnfcgi_request_t *req)
     res = 0;
     if (!req->flags.complete) {
         if (MNUNLIKELY(
-                (res = bytestream_produce_data(
-                    &req->ctx->out,
-                    req->ctx->fp)) != 0)) {
+                (res = mnfcgi_ctx_flush(req->ctx)) != 0)) {
             res = MNFCGI_IO_ERROR;
         }
-        bytestream_rewind(&req->ctx->out);
     } else {
         res = MNFCGI_REQUEST_COMPLETED;
     }
@@ -1383,6 +3411,9 @@ mnfcgi_finalize_request(mnfcgi_request_t *req)
     mnfcgi_header_t *h;
 
     if (!req->flags.complete) {
+        if (MNUNLIKELY(mnfcgi_ctx_out_wait(req->ctx) != 0)) {
+            return MNFCGI_IO_ERROR;
+        }
         while ((h = STQUEUE_HEAD(&req->_stdout)) != NULL) {
             mnfcgi_record_t *rec;
 
@@ -1402,14 +3433,12 @@ mnfcgi_finalize_request(mnfcgi_request_t *req)
                 MNFCGI_REQUEST_COMPLETE,
                 0) != 0) {
         }
+        req->flags.complete = -1;
 
         if (MNUNLIKELY(
-                (res = bytestream_produce_data(
-                    &req->ctx->out,
-                    req->ctx->fp)) != 0)) {
+                (res = mnfcgi_ctx_flush(req->ctx)) != 0)) {
             res = MNFCGI_IO_ERROR;
         }
-        req->flags.complete = -1;
     } else {
         while ((h = STQUEUE_HEAD(&req->_stdout)) != NULL) {
             mnfcgi_record_t *rec;
@@ -1420,9 +3449,10 @@ mnfcgi_finalize_request(mnfcgi_request_t *req)
         res = MNFCGI_REQUEST_COMPLETED;
     }
 
-    bytestream_rewind(&req->ctx->in);
-    bytestream_rewind(&req->ctx->out);
-
+    /*
+     * ctx->in and ctx->out are left alone, they may hold records of other
+     * requests
+     */
     return res;
 }
 
@@ -1461,57 +3491,219 @@ mnfcgi_cat(mnbytestream_t *bs, size_t sz, const char *data)
 static int
 mnfcgi_handle_socket(UNUSED int argc, void **argv)
 {
-    mnfcgi_ctx_t ctx;
+    mnfcgi_ctx_t *ctx;
     mnfcgi_config_t *config;
     int fd;
 
     config = argv[0];
-    ++config->stats.nthreads;
+    (void)MNFCGI_ATOMIC_ADD(&config->stats.nthreads, 1);
     fd = (int)(intptr_t)argv[1];
-    mnfcgi_ctx_init(&ctx, config, fd);
-    ctx.thread = mnthr_me();
-    _mnfcgi_handle_socket(&ctx);
-    ctx.thread = NULL;
-    --config->stats.nthreads;
-    mnfcgi_ctx_fini(&ctx);
+    ctx = mnfcgi_ctx_new(config, fd);
+    ctx->thread = mnthr_me();
+    _mnfcgi_handle_socket(ctx);
+    ctx->thread = NULL;
+    (void)MNFCGI_ATOMIC_SUB(&config->stats.nthreads, 1);
+    mnfcgi_ctx_destroy(&ctx);
     return 0;
 }
 
 
+/*
+ * Like mnthr_socket_bind(), optionally with SO_REUSEPORT, so that each
+ * worker process or OS thread can have a listener of its own on the same
+ * address.
+ */
+static int
+mnfcgi_socket_bind(const char *host, const char *port, bool reuseport)
+{
+    struct addrinfo hints, *ai, *rp;
+    int fd;
+
+    memset(&hints, '\0', sizeof(hints));
+    hints.ai_family = PF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    if (getaddrinfo(host, port, &hints, &ai) != 0) {
+        return -1;
+    }
+
+    fd = -1;
+    for (rp = ai; rp != NULL; rp = rp->ai_next) {
+        int optval;
+
+        if ((fd = socket(rp->ai_family,
+                         rp->ai_socktype,
+                         rp->ai_protocol)) == -1) {
+            continue;
+        }
+
+        optval = 1;
+        if (setsockopt(fd,
+                       SOL_SOCKET,
+                       SO_REUSEADDR,
+                       &optval,
+                       sizeof(optval)) != 0 ||
+            (reuseport && setsockopt(fd,
+                                     SOL_SOCKET,
+                                     SO_REUSEPORT,
+                                     &optval,
+                                     sizeof(optval)) != 0) ||
+            fcntl(fd, F_SETFL, O_NONBLOCK) != 0 ||
+            bind(fd, rp->ai_addr, rp->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        break;
+    }
+
+    freeaddrinfo(ai);
+    return fd;
+}
+
+
+/*
+ * Whether the socket file at addr is left over, that is, nobody accepts
+ * on it.  A non-blocking connect() does not wait on a full backlog.
+ */
+static bool
+mnfcgi_socket_unix_stale(struct sockaddr_un *addr, socklen_t sz)
+{
+    bool res;
+    int fd;
+
+    if ((fd = socket(PF_LOCAL, SOCK_STREAM, 0)) == -1) {
+        return false;
+    }
+    res = fcntl(fd, F_SETFL, O_NONBLOCK) == 0 &&
+          connect(fd, (struct sockaddr *)addr, sz) != 0 &&
+          errno == ECONNREFUSED;
+    close(fd);
+    return res;
+}
+
+
+/*
+ * Bind a local socket at path, or @name in the abstract namespace (Linux).
+ * A stale socket file is removed first, one that another server listens
+ * on is left alone, and bind() fails.
+ */
+static int
+mnfcgi_socket_bind_unix(mnfcgi_config_t *config, const char *path)
+{
+    struct sockaddr_un addr;
+    socklen_t sz;
+    size_t len;
+    int fd;
+
+    len = strlen(path);
+    if (len == 0 || len >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+
+    memset(&addr, '\0', sizeof(addr));
+    addr.sun_family = AF_LOCAL;
+    if (*path == '@') {
+        /* abstract, not nul-terminated */
+        memcpy(addr.sun_path + 1, path + 1, len - 1);
+        sz = offsetof(struct sockaddr_un, sun_path) + len;
+    } else {
+        struct stat sb;
+
+        memcpy(addr.sun_path, path, len);
+        sz = sizeof(addr);
+        if (lstat(path, &sb) == 0 &&
+            S_ISSOCK(sb.st_mode) &&
+            mnfcgi_socket_unix_stale(&addr, sz)) {
+            (void)unlink(path);
+        }
+    }
+
+    if ((fd = socket(PF_LOCAL, SOCK_STREAM, 0)) == -1) {
+        return -1;
+    }
+
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) != 0 ||
+        bind(fd, (struct sockaddr *)&addr, sz) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    if (*path != '@') {
+        if ((config->unix_uid != (uid_t)-1 ||
+             config->unix_gid != (gid_t)-1) &&
+            chown(path, config->unix_uid, config->unix_gid) != 0) {
+            CTRACE("chown %s: %s", path, strerror(errno));
+        }
+        if (config->unix_mode != (mode_t)-1 &&
+            chmod(path, config->unix_mode) != 0) {
+            CTRACE("chmod %s: %s", path, strerror(errno));
+        }
+    }
+
+    return fd;
+}
+
+
+/*
+ * Return a listening socket, or -1.  Does not need mnthr to be running.
+ * There is no SO_REUSEPORT for local sockets.
+ */
 int
-mnfcgi_serve(mnfcgi_config_t *config)
+mnfcgi_listen(mnfcgi_config_t *config, bool reuseport)
 {
-    int res;
-    res = 0;
+    const char *path;
+    int fd;
 
-    if ((config->fd = mnthr_socket_bind(BCDATA(config->host),
-                                  BCDATA(config->port),
-                                  PF_INET)) == -1) {
-        res = MNFCGI_SERVE + 1;
-        goto end;
+    if ((path = mnfcgi_config_unix_path(config)) != NULL) {
+        if ((fd = mnfcgi_socket_bind_unix(config, path)) == -1) {
+            return -1;
+        }
+    } else {
+        if ((fd = mnfcgi_socket_bind(BCDATA(config->host),
+                                     BCDATA(config->port),
+                                     reuseport)) == -1) {
+            return -1;
+        }
     }
 
-    CTRACE("mnfcgi listening on %s:%s",
+    if (listen(fd, config->max_conn) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    CTRACE("mnfcgi listening on %s:%s%s",
            BDATA(config->host),
-           BDATA(config->port));
+           BDATA(config->port),
+           reuseport ? " (reuseport)" : "");
 
-    if (listen(config->fd, config->max_conn) != 0) {
-        res = MNFCGI_SERVE + 2;
-        goto end;
-    }
+    return fd;
+}
+
+
+/*
+ * Accept connections on fd, and serve each in an mnthr thread.
+ */
+int
+mnfcgi_serve_fd(mnfcgi_config_t *config, int fd)
+{
+    int res;
 
+    res = 0;
+    _ctx_pool.stopping = false;
     while (true) {
         mnthr_socket_t *sockets;
         off_t sz, i;
 
         sockets = NULL;
         sz = 0;
-        if ((res = mnthr_accept_all2(config->fd, &sockets, &sz)) != 0) {
+        if ((res = mnthr_accept_all2(fd, &sockets, &sz)) != 0) {
             res = MNFCGI_SERVE + 3;
             if (sockets != NULL) {
                 free(sockets);
             }
-            goto end;
+            break;
         }
 
         for (i = 0; i < sz; ++i) {
@@ -1525,6 +3717,59 @@ mnfcgi_serve(mnfcgi_config_t *config)
         free(sockets);
     }
 
+    _ctx_pool.stopping = true;
+    if (_ctx_pool.nlive == 0) {
+        mnfcgi_ctx_pool_fini();
+    }
+    return res;
+}
+
+
+int
+mnfcgi_serve(mnfcgi_config_t *config)
+{
+    int res;
+    res = 0;
+
+    if (config->fd != -1) {
+        /* a local socket bound by mnfcgi_prefork() */
+        goto serve;
+    }
+
+    if (config->family == PF_LOCAL) {
+        if ((config->fd = mnfcgi_listen(config, false)) == -1) {
+            res = MNFCGI_SERVE + 1;
+            goto end;
+        }
+        goto serve;
+    }
+
+    if (config->reuseport) {
+        config->fd = mnfcgi_socket_bind(BCDATA(config->host),
+                                        BCDATA(config->port),
+                                        true);
+    } else {
+        config->fd = mnthr_socket_bind(BCDATA(config->host),
+                                       BCDATA(config->port),
+                                       PF_INET);
+    }
+    if (config->fd == -1) {
+        res = MNFCGI_SERVE + 1;
+        goto end;
+    }
+
+    CTRACE("mnfcgi listening on %s:%s",
+           BDATA(config->host),
+           BDATA(config->port));
+
+    if (listen(config->fd, config->max_conn) != 0) {
+        res = MNFCGI_SERVE + 2;
+        goto end;
+    }
+
+serve:
+    res = mnfcgi_serve_fd(config, config->fd);
+
 end:
     return res;
 }
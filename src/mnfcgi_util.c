@@ -1,3 +1,10 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
 #include <mncommon/bytes.h>
 #include <mncommon/hash.h>
 #include <mncommon/dumpm.h>
@@ -7,3 +14,306 @@
 
 #include "diag.h"
 
+/*
+ * mnfcgi_arena_t
+ */
+#define MNFCGI_ARENA_ALIGN(sz) (((sz) + 7) & ~((size_t)7))
+
+/*
+ * Arena-backed bytes carry the reference count of a static initializer so
+ * that BYTES_DECREF() never frees them.
+ */
+static mnbytes_t _arena_bytes_proto = BYTES_INITIALIZER("");
+
+
+void
+mnfcgi_arena_init(mnfcgi_arena_t *arena, size_t chunksz)
+{
+    arena->chunks = NULL;
+    arena->chunksz = MNFCGI_ARENA_ALIGN(chunksz);
+}
+
+
+void
+mnfcgi_arena_fini(mnfcgi_arena_t *arena)
+{
+    mnfcgi_arena_chunk_t *chunk;
+
+    while ((chunk = arena->chunks) != NULL) {
+        arena->chunks = chunk->next;
+        free(chunk);
+    }
+}
+
+
+void *
+mnfcgi_arena_alloc(mnfcgi_arena_t *arena, size_t sz)
+{
+    mnfcgi_arena_chunk_t *chunk;
+    void *res;
+
+    assert(arena->chunksz > 0);
+
+    sz = MNFCGI_ARENA_ALIGN(sz);
+    chunk = arena->chunks;
+    if (chunk == NULL || (chunk->sz - chunk->pos) < sz) {
+        size_t csz;
+
+        csz = sz > arena->chunksz ? sz : arena->chunksz;
+        if (MNUNLIKELY((chunk = malloc(sizeof(mnfcgi_arena_chunk_t) +
+                                       csz)) == NULL)) {
+            FAIL("malloc");
+        }
+        chunk->sz = csz;
+        chunk->pos = 0;
+        /*
+         * a dedicated oversized chunk goes behind the current one, so that
+         * its free space is not wasted
+         */
+        if (csz > arena->chunksz && arena->chunks != NULL) {
+            chunk->next = arena->chunks->next;
+            arena->chunks->next = chunk;
+        } else {
+            chunk->next = arena->chunks;
+            arena->chunks = chunk;
+        }
+    }
+
+    res = chunk->data + chunk->pos;
+    chunk->pos += sz;
+    return res;
+}
+
+
+static mnbytes_t *
+mnfcgi_arena_bytes_new(mnfcgi_arena_t *arena, size_t sz)
+{
+    mnbytes_t *res;
+
+    res = mnfcgi_arena_alloc(arena, sizeof(mnbytes_t) + sz);
+    res->nref = _arena_bytes_proto.nref;
+    res->sz = sz;
+    res->hash = 0;
+    return res;
+}
+
+
+mnbytes_t *
+mnfcgi_arena_bytes_new_from_str_len(mnfcgi_arena_t *arena,
+                                    const char *s,
+                                    size_t sz)
+{
+    mnbytes_t *res;
+
+    if (arena->chunksz == 0) {
+        return bytes_new_from_str_len(s, sz);
+    }
+
+    res = mnfcgi_arena_bytes_new(arena, sz + 1);
+    memcpy(BDATA(res), s, sz);
+    BDATA(res)[sz] = '\0';
+    return res;
+}
+
+
+mnbytes_t *
+mnfcgi_arena_bytes_vprintf(mnfcgi_arena_t *arena,
+                           const char *fmt,
+                           va_list ap)
+{
+    mnbytes_t *res;
+    va_list ap_copy;
+    int sz;
+
+    if (arena->chunksz == 0) {
+        return bytes_vprintf(fmt, ap);
+    }
+
+    va_copy(ap_copy, ap);
+    sz = vsnprintf(NULL, 0, fmt, ap_copy);
+    va_end(ap_copy);
+    if (MNUNLIKELY(sz < 0)) {
+        FAIL("vsnprintf");
+    }
+
+    res = mnfcgi_arena_bytes_new(arena, sz + 1);
+    (void)vsnprintf((char *)BDATA(res), sz + 1, fmt, ap);
+    return res;
+}
+
+
+/*
+ * SipHash-1-3 with a key drawn once per process, so that a client cannot
+ * pick parameter names that collide in the parameter table.  A prefork
+ * supervisor never hashes, each worker draws a key of its own.
+ */
+static uint64_t _str_hash_key[2];
+static pthread_once_t _str_hash_once = PTHREAD_ONCE_INIT;
+
+
+static void
+mnfcgi_str_hash_init(void)
+{
+    int fd;
+    ssize_t nread;
+
+    nread = -1;
+    if ((fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC)) != -1) {
+        nread = read(fd, _str_hash_key, sizeof(_str_hash_key));
+        (void)close(fd);
+    }
+    if (nread != (ssize_t)sizeof(_str_hash_key)) {
+        struct timespec ts;
+
+        CTRACE("could not read /dev/urandom, hash key is weak");
+        (void)clock_gettime(CLOCK_REALTIME, &ts);
+        _str_hash_key[0] = ((uint64_t)ts.tv_sec << 32) ^
+                           (uint64_t)ts.tv_nsec ^
+                           (uint64_t)(uintptr_t)&ts;
+        _str_hash_key[1] = ((uint64_t)getpid() << 32) ^
+                           (uint64_t)(uintptr_t)mnfcgi_str_hash_init;
+    }
+}
+
+
+#define MNFCGI_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define MNFCGI_SIPROUND(v0, v1, v2, v3)         \
+do {                                            \
+    v0 += v1;                                   \
+    v1 = MNFCGI_ROTL(v1, 13);                   \
+    v1 ^= v0;                                   \
+    v0 = MNFCGI_ROTL(v0, 32);                   \
+    v2 += v3;                                   \
+    v3 = MNFCGI_ROTL(v3, 16);                   \
+    v3 ^= v2;                                   \
+    v0 += v3;                                   \
+    v3 = MNFCGI_ROTL(v3, 21);                   \
+    v3 ^= v0;                                   \
+    v2 += v1;                                   \
+    v1 = MNFCGI_ROTL(v1, 17);                   \
+    v1 ^= v2;                                   \
+    v2 = MNFCGI_ROTL(v2, 32);                   \
+} while (0)                                     \
+
+
+uint64_t
+mnfcgi_str_hash(const void *s, size_t sz)
+{
+    const unsigned char *p;
+    uint64_t v0, v1, v2, v3, m;
+    size_t i, n;
+
+    (void)pthread_once(&_str_hash_once, mnfcgi_str_hash_init);
+
+    v0 = _str_hash_key[0] ^ 0x736f6d6570736575ULL;
+    v1 = _str_hash_key[1] ^ 0x646f72616e646f6dULL;
+    v2 = _str_hash_key[0] ^ 0x6c7967656e657261ULL;
+    v3 = _str_hash_key[1] ^ 0x7465646279746573ULL;
+
+    p = s;
+    for (n = sz & ~((size_t)7); n > 0; n -= 8, p += 8) {
+        for (m = 0, i = 0; i < 8; ++i) {
+            m |= (uint64_t)p[i] << (8 * i);
+        }
+        v3 ^= m;
+        MNFCGI_SIPROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+
+    m = (uint64_t)sz << 56;
+    for (i = 0; i < (sz & 7); ++i) {
+        m |= (uint64_t)p[i] << (8 * i);
+    }
+    v3 ^= m;
+    MNFCGI_SIPROUND(v0, v1, v2, v3);
+    v0 ^= m;
+
+    v2 ^= 0xff;
+    MNFCGI_SIPROUND(v0, v1, v2, v3);
+    MNFCGI_SIPROUND(v0, v1, v2, v3);
+    MNFCGI_SIPROUND(v0, v1, v2, v3);
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+
+/*
+ * HTTP-date, per thread.  The current second is kept apart, other
+ * timestamps (Expires, Last-Modified) go to a small LRU.  The cache holds
+ * a reference to every value it hands out.
+ */
+#define MNFCGI_DATE_CACHE_SZ 8
+
+typedef struct _mnfcgi_date {
+    time_t t;
+    mnbytes_t *value;
+    uint64_t used;
+} mnfcgi_date_t;
+
+static __thread struct {
+    mnfcgi_date_t now;
+    mnfcgi_date_t lru[MNFCGI_DATE_CACHE_SZ];
+    uint64_t tick;
+} _date_cache;
+
+
+static mnbytes_t *
+mnfcgi_http_date_render(time_t t)
+{
+    struct tm tv;
+    char buf[64];
+    size_t n;
+
+    // Wdy, DD Mmm YYYY HH:MM:SS GMT
+    (void)gmtime_r(&t, &tv);
+    n = strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tv);
+    return bytes_new_from_str_len(buf, n);
+}
+
+
+static void
+mnfcgi_date_set(mnfcgi_date_t *d, time_t t)
+{
+    BYTES_DECREF(&d->value);
+    d->t = t;
+    d->value = mnfcgi_http_date_render(t);
+    BYTES_INCREF(d->value);
+}
+
+
+/*
+ * Return the HTTP-date for t, with a reference held by the cache.
+ */
+mnbytes_t *
+mnfcgi_http_date(time_t t)
+{
+    mnfcgi_date_t *d, *victim;
+    unsigned i;
+
+    /* only the current second goes to the now slot */
+    if (MNLIKELY(t == time(NULL))) {
+        d = &_date_cache.now;
+        if (MNUNLIKELY(d->value == NULL || d->t != t)) {
+            mnfcgi_date_set(d, t);
+        }
+        return d->value;
+    }
+
+    ++_date_cache.tick;
+    victim = &_date_cache.lru[0];
+    for (i = 0; i < MNFCGI_DATE_CACHE_SZ; ++i) {
+        d = &_date_cache.lru[i];
+        if (d->value != NULL && d->t == t) {
+            d->used = _date_cache.tick;
+            return d->value;
+        }
+        if (d->used < victim->used) {
+            victim = d;
+        }
+    }
+
+    mnfcgi_date_set(victim, t);
+    victim->used = _date_cache.tick;
+    return victim->value;
+}
@@ -2,6 +2,7 @@
 #include <arpa/inet.h>
 
 #include <errno.h>
+#include <string.h>
 
 #include <mncommon/bytestream.h>
 #include <mncommon/dumpm.h>
@@ -32,6 +33,7 @@ params_item_fini(void *k, void *v)
     __a1                                               \
     rec = (mnfcgi_record_t *)tmp;                      \
     STQUEUE_ENTRY_INIT(link, &rec->header);            \
+    rec->header.pool = NULL;                           \
     rec->header.version = MNFCGI_VERSION;              \
     rec->header.type = ty;                             \
     rec->header.rid = 0;                               \
@@ -84,11 +86,10 @@ mnfcgi_record_new(uint8_t ty)
 
         case MNFCGI_PARAMS:
             MNFCGI_REC_INITIALIZER(mnfcgi_params_t,
-                    hash_init(&tmp->params,
-                              127,
-                              _bytes_hash,
-                              _bytes_cmp,
-                              params_item_fini);
+                    tmp->bs = NULL;
+                    tmp->params = NULL;
+                    tmp->nparams = 0;
+                    tmp->szparams = 0;
                     );
             break;
 
@@ -118,6 +119,7 @@ mnfcgi_record_new(uint8_t ty)
         case MNFCGI_STDERR:
             MNFCGI_REC_INITIALIZER(mnfcgi_stderr_t,
                     tmp->render = NULL;
+                    tmp->udata = NULL;
                     );
             break;
 
@@ -147,35 +149,220 @@ mnfcgi_record_new(uint8_t ty)
 }
 
 
+/*
+ * Drop what the record refers to, but keep its own allocations.
+ */
+static void
+mnfcgi_record_clear(mnfcgi_record_t *rec)
+{
+    switch (rec->header.type) {
+    case MNFCGI_PARAMS:
+        {
+            mnfcgi_params_t *tmp = (mnfcgi_params_t *)rec;
+            size_t i;
+
+            for (i = 0; i < tmp->nparams; ++i) {
+                BYTES_DECREF(&tmp->params[i].bvalue);
+            }
+            tmp->nparams = 0;
+            tmp->bs = NULL;
+        }
+        break;
+
+    case MNFCGI_GET_VALUES:
+    case MNFCGI_GET_VALUES_RESULT:
+        {
+            mnfcgi_get_values_t *tmp = (mnfcgi_get_values_t *)rec;
+            mnhash_iter_t it;
+            mnhash_item_t *hit;
+
+            while ((hit = hash_first(&tmp->values, &it)) != NULL) {
+                hash_delete_pair(&tmp->values, hit);
+            }
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+
+static void
+mnfcgi_record_free(mnfcgi_record_t *rec)
+{
+    switch (rec->header.type) {
+    case MNFCGI_PARAMS:
+        {
+            mnfcgi_params_t *tmp = (mnfcgi_params_t *)rec;
+
+            if (tmp->params != NULL) {
+                free(tmp->params);
+                tmp->params = NULL;
+            }
+        }
+        break;
+
+    case MNFCGI_GET_VALUES:
+    case MNFCGI_GET_VALUES_RESULT:
+        {
+            mnfcgi_get_values_t *tmp = (mnfcgi_get_values_t *)rec;
+            hash_fini(&tmp->values);
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    free(rec);
+}
+
+
 void
 mnfcgi_record_destroy(mnfcgi_record_t **rec)
 {
     if (*rec != NULL) {
+        mnfcgi_record_pool_t *pool;
+        unsigned idx;
+
         STQUEUE_ENTRY_FINI(link, &(*rec)->header);
+        mnfcgi_record_clear(*rec);
 
-        switch ((*rec)->header.type) {
-        case MNFCGI_PARAMS:
-            {
-                mnfcgi_params_t *tmp = (mnfcgi_params_t *)(*rec);
-                hash_fini(&tmp->params);
-            }
-            break;
+        pool = (*rec)->header.pool;
+        idx = MNFCGI_RECORD_POOL_IDX((*rec)->header.type);
+        if (pool != NULL && pool->nfree[idx] < pool->cap) {
+            STQUEUE_ENQUEUE(&pool->free[idx], link, &(*rec)->header);
+            ++pool->nfree[idx];
+        } else {
+            mnfcgi_record_free(*rec);
+        }
+        *rec = NULL;
+    }
+}
 
-        case MNFCGI_GET_VALUES:
-        case MNFCGI_GET_VALUES_RESULT:
-            {
-                mnfcgi_get_values_t *tmp = (mnfcgi_get_values_t *)(*rec);
-                hash_fini(&tmp->values);
-            }
-            break;
 
-        default:
-            break;
+/*
+ * mnfcgi_record_pool_t
+ */
+static void
+mnfcgi_record_reinit(mnfcgi_record_t *rec, uint8_t ty)
+{
+    rec->header.version = MNFCGI_VERSION;
+    rec->header.type = ty;
+    rec->header.rid = 0;
+    rec->header.rsz = 0;
+    rec->header.psz = 0;
+    rec->header.reserved = 0;
+
+    switch (ty) {
+    case MNFCGI_BEGIN_REQUEST:
+        rec->begin_request.role = 0;
+        rec->begin_request.flags = 0;
+        break;
+
+    case MNFCGI_END_REQUEST:
+        rec->end_request.proto_status = 0;
+        rec->end_request.app_status = 0;
+        break;
+
+    case MNFCGI_STDIN:
+        rec->_stdin.br.start = 0;
+        rec->_stdin.br.end = 0;
+        rec->_stdin.parse = NULL;
+        break;
+
+    case MNFCGI_DATA:
+        rec->data.br.start = 0;
+        rec->data.br.end = 0;
+        rec->data.parse = NULL;
+        break;
+
+    case MNFCGI_STDOUT:
+        rec->_stdout.render = NULL;
+        rec->_stdout.udata = NULL;
+        break;
+
+    case MNFCGI_STDERR:
+        rec->_stderr.render = NULL;
+        rec->_stderr.udata = NULL;
+        break;
+
+    case MNFCGI_UNKNOWN_TYPE:
+        rec->unknown_type.type = 0;
+        break;
+
+    default:
+        break;
+    }
+}
+
+
+void
+mnfcgi_record_pool_init(mnfcgi_record_pool_t *pool, size_t cap)
+{
+    unsigned i;
+
+    for (i = 0; i < countof(pool->free); ++i) {
+        STQUEUE_INIT(&pool->free[i]);
+        pool->nfree[i] = 0;
+    }
+    pool->cap = cap;
+    pool->nhits = 0;
+    pool->nmisses = 0;
+}
+
+
+void
+mnfcgi_record_pool_fini(mnfcgi_record_pool_t *pool)
+{
+    unsigned i;
+
+    for (i = 0; i < countof(pool->free); ++i) {
+        mnfcgi_header_t *h;
+
+        while ((h = STQUEUE_HEAD(&pool->free[i])) != NULL) {
+            STQUEUE_DEQUEUE(&pool->free[i], link);
+            STQUEUE_ENTRY_FINI(link, h);
+            mnfcgi_record_free((mnfcgi_record_t *)h);
         }
+        pool->nfree[i] = 0;
+    }
+}
 
-        free(*rec);
-        *rec = NULL;
+
+/*
+ * Take a record of type ty off the freelist, or make a new one that will
+ * be returned to the pool on mnfcgi_record_destroy().
+ */
+mnfcgi_record_t *
+mnfcgi_record_pool_get(mnfcgi_record_pool_t *pool, uint8_t ty)
+{
+    mnfcgi_record_t *rec;
+    mnfcgi_header_t *h;
+    unsigned idx;
+
+    if (pool == NULL || ty > MNFCGI_MAXTYPE) {
+        return mnfcgi_record_new(ty);
     }
+
+    idx = MNFCGI_RECORD_POOL_IDX(ty);
+    if ((h = STQUEUE_HEAD(&pool->free[idx])) != NULL) {
+        STQUEUE_DEQUEUE(&pool->free[idx], link);
+        STQUEUE_ENTRY_INIT(link, h);
+        --pool->nfree[idx];
+        ++pool->nhits;
+        rec = (mnfcgi_record_t *)h;
+        mnfcgi_record_reinit(rec, ty);
+
+    } else {
+        if ((rec = mnfcgi_record_new(ty)) != NULL) {
+            rec->header.pool = pool;
+            ++pool->nmisses;
+        }
+    }
+
+    return rec;
 }
 
 
@@ -206,39 +393,71 @@ do {                                                   \
 #define MNFCGI_RENDER_INT4(bs, v) SCATI(bs, uint32_t, htonl(v))
 
 
-#define MNFCGI_PARSE_KVP_FNONULL 0x01
+/*
+ * Decode the name and value lengths of a name-value pair at the current
+ * position of bs, return the size of the length prefix, or -1 if the pair
+ * does not fit into avail bytes.
+ */
 static ssize_t
-mnfcgi_parse_kvp(UNUSED mnfcgi_record_t *rec,
-                 mnbytestream_t *bs,
-                 mnbytes_t **key,
-                 mnbytes_t **value,
-                 int flags)
+mnfcgi_parse_kvp_len(mnbytestream_t *bs, ssize_t avail, int *ksz, int *vsz)
 {
     int idx;
     uint8_t probe;
-    int ksz, vsz;
 
     idx = 0;
+    if (MNUNLIKELY(avail < 2)) {
+        return -1;
+    }
     probe = MNFCGI_PARSE_CHAR(bs, idx);
-    if (!(probe & 0x800)) {
-        ksz = probe;
+    if (!(probe & 0x80)) {
+        *ksz = probe;
         idx += 1;
 
     } else {
-        ksz = MNFCGI_PARSE_INT(bs, idx);
+        if (MNUNLIKELY(avail < idx + 4 + 1)) {
+            return -1;
+        }
+        *ksz = MNFCGI_PARSE_INT(bs, idx);
         idx += 4;
     }
 
     probe = MNFCGI_PARSE_CHAR(bs, idx);
-    if (!(probe & 0x800)) {
-        vsz = probe;
+    if (!(probe & 0x80)) {
+        *vsz = probe;
         idx += 1;
 
     } else {
-        vsz = MNFCGI_PARSE_INT(bs, idx);
+        if (MNUNLIKELY(avail < idx + 4)) {
+            return -1;
+        }
+        *vsz = MNFCGI_PARSE_INT(bs, idx);
         idx += 4;
     }
 
+    if (MNUNLIKELY(avail - idx < (ssize_t)*ksz + (ssize_t)*vsz)) {
+        return -1;
+    }
+
+    return idx;
+}
+
+
+#define MNFCGI_PARSE_KVP_FNONULL 0x01
+static ssize_t
+mnfcgi_parse_kvp(UNUSED mnfcgi_record_t *rec,
+                 mnbytestream_t *bs,
+                 ssize_t avail,
+                 mnbytes_t **key,
+                 mnbytes_t **value,
+                 int flags)
+{
+    ssize_t idx;
+    int ksz, vsz;
+
+    if (MNUNLIKELY((idx = mnfcgi_parse_kvp_len(bs, avail, &ksz, &vsz)) < 0)) {
+        return -1;
+    }
+
     if (ksz > 0) {
         *key = bytes_new_from_str_len(SDATA(bs, SPOS(bs) + idx), ksz);
 
@@ -267,6 +486,176 @@ mnfcgi_parse_kvp(UNUSED mnfcgi_record_t *rec,
 }
 
 
+/*
+ * Same as mnfcgi_parse_kvp(), but only record where the name and the value
+ * are found in bs.
+ */
+static ssize_t
+mnfcgi_parse_kvp_range(mnbytestream_t *bs,
+                       ssize_t avail,
+                       byterange_t *key,
+                       byterange_t *value)
+{
+    ssize_t idx;
+    int ksz, vsz;
+
+    if (MNUNLIKELY((idx = mnfcgi_parse_kvp_len(bs, avail, &ksz, &vsz)) < 0)) {
+        return -1;
+    }
+
+    key->start = SPOS(bs) + idx;
+    key->end = key->start + ksz;
+    value->start = key->end;
+    value->end = value->start + vsz;
+
+    return idx + ksz + vsz;
+}
+
+
+/*
+ * Return the mnfcgi_cgi_var_t of a parameter name, or -1.
+ */
+#define MNFCGI_CGI_VAR_MATCH(s, sz, name, var)                 \
+    if ((sz) == sizeof(name) - 1 && memcmp((s), (name), (sz)) == 0) {  \
+        return (var);                                          \
+    }                                                          \
+
+int
+mnfcgi_cgi_var(const char *s, size_t sz)
+{
+    if (sz < 9 || sz > 17) {
+        return -1;
+    }
+
+    switch (s[0]) {
+    case 'A':
+        MNFCGI_CGI_VAR_MATCH(s, sz, "AUTH_TYPE", MNFCGI_CGI_AUTH_TYPE);
+        break;
+
+    case 'C':
+        MNFCGI_CGI_VAR_MATCH(s, sz, "CONTENT_LENGTH",
+                             MNFCGI_CGI_CONTENT_LENGTH);
+        MNFCGI_CGI_VAR_MATCH(s, sz, "CONTENT_TYPE",
+                             MNFCGI_CGI_CONTENT_TYPE);
+        break;
+
+    case 'G':
+        MNFCGI_CGI_VAR_MATCH(s, sz, "GATEWAY_INTERFACE",
+                             MNFCGI_CGI_GATEWAY_INTERFACE);
+        break;
+
+    case 'H':
+        MNFCGI_CGI_VAR_MATCH(s, sz, "HTTP_COOKIE", MNFCGI_CGI_HTTP_COOKIE);
+        MNFCGI_CGI_VAR_MATCH(s, sz, "HTTP_HOST", MNFCGI_CGI_HTTP_HOST);
+        break;
+
+    case 'P':
+        MNFCGI_CGI_VAR_MATCH(s, sz, "PATH_INFO", MNFCGI_CGI_PATH_INFO);
+        MNFCGI_CGI_VAR_MATCH(s, sz, "PATH_TRANSLATED",
+                             MNFCGI_CGI_PATH_TRANSLATED);
+        break;
+
+    case 'Q':
+        MNFCGI_CGI_VAR_MATCH(s, sz, "QUERY_STRING",
+                             MNFCGI_CGI_QUERY_STRING);
+        break;
+
+    case 'R':
+        if (s[2] == 'M') {
+            MNFCGI_CGI_VAR_MATCH(s, sz, "REMOTE_ADDR",
+                                 MNFCGI_CGI_REMOTE_ADDR);
+            MNFCGI_CGI_VAR_MATCH(s, sz, "REMOTE_HOST",
+                                 MNFCGI_CGI_REMOTE_HOST);
+            MNFCGI_CGI_VAR_MATCH(s, sz, "REMOTE_IDENT",
+                                 MNFCGI_CGI_REMOTE_IDENT);
+            MNFCGI_CGI_VAR_MATCH(s, sz, "REMOTE_USER",
+                                 MNFCGI_CGI_REMOTE_USER);
+        } else {
+            MNFCGI_CGI_VAR_MATCH(s, sz, "REQUEST_METHOD",
+                                 MNFCGI_CGI_REQUEST_METHOD);
+            MNFCGI_CGI_VAR_MATCH(s, sz, "REQUEST_SCHEME",
+                                 MNFCGI_CGI_REQUEST_SCHEME);
+            MNFCGI_CGI_VAR_MATCH(s, sz, "REQUEST_URI",
+                                 MNFCGI_CGI_REQUEST_URI);
+        }
+        break;
+
+    case 'S':
+        if (s[1] == 'C') {
+            MNFCGI_CGI_VAR_MATCH(s, sz, "SCRIPT_NAME",
+                                 MNFCGI_CGI_SCRIPT_NAME);
+        } else {
+            MNFCGI_CGI_VAR_MATCH(s, sz, "SERVER_NAME",
+                                 MNFCGI_CGI_SERVER_NAME);
+            MNFCGI_CGI_VAR_MATCH(s, sz, "SERVER_PORT",
+                                 MNFCGI_CGI_SERVER_PORT);
+            MNFCGI_CGI_VAR_MATCH(s, sz, "SERVER_PROTOCOL",
+                                 MNFCGI_CGI_SERVER_PROTOCOL);
+            MNFCGI_CGI_VAR_MATCH(s, sz, "SERVER_SOFTWARE",
+                                 MNFCGI_CGI_SERVER_SOFTWARE);
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    return -1;
+}
+
+
+static mnfcgi_param_t *
+mnfcgi_params_incr(mnfcgi_params_t *params)
+{
+    if (params->nparams == params->szparams) {
+        size_t sz;
+        mnfcgi_param_t *tmp;
+
+        sz = params->szparams > 0 ? params->szparams * 2 : 16;
+        if (MNUNLIKELY((tmp = realloc(params->params,
+                                      sz * sizeof(mnfcgi_param_t))) == NULL)) {
+            FAIL("realloc");
+        }
+        params->params = tmp;
+        params->szparams = sz;
+    }
+    return &params->params[params->nparams++];
+}
+
+
+/*
+ * Return the value of the first pair named name, or NULL.  The returned
+ * instance is owned by the record, and is allocated from arena.
+ */
+mnbytes_t *
+mnfcgi_params_get(mnfcgi_params_t *params,
+                  const mnbytes_t *name,
+                  mnfcgi_arena_t *arena)
+{
+    size_t i, sz;
+
+    sz = BSZ(name) - 1;
+    for (i = 0; i < params->nparams; ++i) {
+        mnfcgi_param_t *p;
+
+        p = &params->params[i];
+        if ((size_t)(p->name.end - p->name.start) == sz &&
+            memcmp(SDATA(params->bs, p->name.start), BCDATA(name), sz) == 0) {
+            if (p->bvalue == NULL) {
+                p->bvalue = mnfcgi_arena_bytes_new_from_str_len(
+                        arena,
+                        SDATA(params->bs, p->value.start),
+                        p->value.end - p->value.start);
+                BYTES_INCREF(p->bvalue);
+            }
+            return p->bvalue;
+        }
+    }
+
+    return NULL;
+}
+
+
 static ssize_t
 mnfcgi_parse_payload(mnbytestream_t *bs, mnfcgi_record_t *rec)
 {
@@ -296,41 +685,34 @@ mnfcgi_parse_payload(mnbytestream_t *bs, mnfcgi_record_t *rec)
     case MNFCGI_PARAMS:
         {
             mnfcgi_params_t *tmp = (mnfcgi_params_t *)rec;
-            mnbytes_t *key, *value;
 
-            for (nread = 0, key = NULL, value = NULL;
-                 nread < rec->header.rsz;) {
+            tmp->bs = bs;
+            for (nread = 0; nread < rec->header.rsz;) {
                 ssize_t n;
+                byterange_t key, value;
 
                 if (MNUNLIKELY(
-                        (n = mnfcgi_parse_kvp(
-                                rec,
+                        (n = mnfcgi_parse_kvp_range(
                                 bs,
+                                rec->header.rsz - nread,
                                 &key,
-                                &value,
-                                MNFCGI_PARSE_KVP_FNONULL)) == -1)) {
+                                &value)) == -1)) {
                     nread = -1;
                     break;
                 }
 
-                //CTRACE("n=%ld nread=%ld param %s=%s",
-                //       n, nread, BDATASAFE(key), BDATASAFE(value));
+                if (MNLIKELY(key.end > key.start)) {
+                    mnfcgi_param_t *p;
 
-                if (key != NULL) {
-                    mnbytes_t *oldkey, *oldvalue;
-                    BYTES_INCREF(key);
-                    BYTES_INCREF(value);
-                    hash_set_item_uniq(&tmp->params,
-                                       key,
-                                       value,
-                                       (void **)&oldkey,
-                                       (void **)&oldvalue);
+                    p = mnfcgi_params_incr(tmp);
+                    p->name = key;
+                    p->value = value;
+                    p->bvalue = NULL;
+                    p->cgi = mnfcgi_cgi_var(SDATA(bs, key.start),
+                                            key.end - key.start);
 
                 } else {
-                    CTRACE("ignoring null key for value: %s",
-                           BDATASAFE(value));
-                    BYTES_DECREF(&key);
-                    BYTES_DECREF(&value);
+                    CTRACE("ignoring null key");
                 }
 
                 nread += n;
@@ -373,6 +755,7 @@ mnfcgi_parse_payload(mnbytestream_t *bs, mnfcgi_record_t *rec)
                         (n = mnfcgi_parse_kvp(
                                 rec,
                                 bs,
+                                rec->header.rsz - nread,
                                 &key,
                                 &value,
                                 0)) == -1)) {
@@ -423,8 +806,27 @@ mnfcgi_parse_padding(mnbytestream_t *bs, mnfcgi_record_t *rec)
 }
 
 
+/*
+ * Return the length of the record at the current position in bs, if it
+ * is completely buffered, otherwise zero.
+ */
+ssize_t
+mnfcgi_frame(mnbytestream_t *bs)
+{
+    ssize_t sz;
+
+    if (SAVAIL(bs) < MNFCGI_HEADER_LEN) {
+        return 0;
+    }
+    sz = MNFCGI_HEADER_LEN +
+         MNFCGI_PARSE_SHORT(bs, 4) +
+         MNFCGI_PARSE_CHAR(bs, 6);
+    return SAVAIL(bs) < sz ? 0 : sz;
+}
+
+
 mnfcgi_record_t *
-mnfcgi_parse(mnbytestream_t *bs, void *fd)
+mnfcgi_parse(mnbytestream_t *bs, void *fd, mnfcgi_record_pool_t *pool)
 {
     int rv;
     mnfcgi_record_t *res;
@@ -435,7 +837,8 @@ mnfcgi_parse(mnbytestream_t *bs, void *fd)
     res = NULL;
 
     //CTRACE(">>> SPOS=%ld SAVAIL=%ld", SPOS(bs), SAVAIL(bs));
-    while (SAVAIL(bs) < MNFCGI_HEADER_LEN) {
+    /* the whole record, including padding, is read in at once */
+    while (mnfcgi_frame(bs) == 0) {
         if ((rv = bytestream_consume_data(bs, fd)) != 0) {
             goto err;
         }
@@ -449,7 +852,7 @@ mnfcgi_parse(mnbytestream_t *bs, void *fd)
 
     //CTRACE("version=%d type=%s", version, MNFCGI_TYPE_STR(type));
 
-    if ((res = mnfcgi_record_new(type)) == NULL) {
+    if ((res = mnfcgi_record_pool_get(pool, type)) == NULL) {
         CTRACE("Unknown type %d version %d", type, version);
         goto err;
     }
@@ -493,16 +896,6 @@ mnfcgi_parse(mnbytestream_t *bs, void *fd)
 
     SADVANCEPOS(bs, MNFCGI_HEADER_LEN);
 
-    //CTRACE(">>> SPOS=%ld SAVAIL=%ld", SPOS(bs), SAVAIL(bs));
-    while (SAVAIL(bs) < res->header.rsz) {
-        if ((rv = bytestream_consume_data(bs, fd)) != 0) {
-            CTRACE("rv=%d errno=%d", rv, errno);
-            perror("qwe");
-            goto err;
-        }
-    }
-    //CTRACE("<<< SPOS=%ld SAVAIL=%ld", SPOS(bs), SAVAIL(bs));
-
     if ((nread = mnfcgi_parse_payload(bs, res)) < res->header.rsz) {
         CTRACE("Could not parse payload rsz=%d nread=%ld",
                res->header.rsz,
@@ -510,12 +903,6 @@ mnfcgi_parse(mnbytestream_t *bs, void *fd)
         goto err;
     }
 
-    while (SAVAIL(bs) < res->header.psz) {
-        if ((rv = bytestream_consume_data(bs, fd)) != 0) {
-            goto err;
-        }
-    }
-
     if ((nread = mnfcgi_parse_padding(bs, res)) < res->header.psz) {
         CTRACE("Could not parse padding psz=%hhd nread=%ld",
                res->header.psz,
@@ -782,6 +1169,25 @@ end:
 }
 
 
+/*
+ * Render the header of a record whose payload and padding go separately.
+ */
+void
+mnfcgi_render_header(mnbytestream_t *bs,
+                     uint8_t type,
+                     uint16_t rid,
+                     uint16_t rsz,
+                     uint8_t psz)
+{
+    MNFCGI_RENDER_CHAR(bs, MNFCGI_VERSION);
+    MNFCGI_RENDER_CHAR(bs, type);
+    MNFCGI_RENDER_SHORT(bs, rid);
+    MNFCGI_RENDER_SHORT(bs, rsz);
+    MNFCGI_RENDER_CHAR(bs, psz);
+    MNFCGI_RENDER_CHAR(bs, 0);
+}
+
+
 void *
 mnfcgi_stdout_get_udata(mnfcgi_record_t *rec)
 {
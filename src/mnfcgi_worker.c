@@ -0,0 +1,504 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__linux__)
+#   include <sched.h>
+#   include <sys/prctl.h>
+#elif defined(__FreeBSD__)
+#   include <sys/param.h>
+#   include <sys/cpuset.h>
+#endif
+
+#include <mncommon/util.h>
+#include <mnthr.h>
+
+#include "mnfcgi_private.h"
+
+#include "diag.h"
+
+/*
+ * Prefork supervisor.  Each worker process binds its own SO_REUSEPORT
+ * listener in mnfcgi_serve(), so that the kernel spreads connections
+ * across workers.
+ */
+
+/* a worker that dies sooner than this is not restarted right away */
+#define MNFCGI_WORKER_MIN_UPTIME 1
+
+typedef struct _mnfcgi_worker {
+    pid_t pid;
+    time_t started;
+} mnfcgi_worker_t;
+
+static volatile sig_atomic_t _shutdown = 0;
+static struct sigaction _osaterm, _osaint, _osachld;
+static sigset_t _osigmask;
+
+
+static void
+mnfcgi_prefork_term(UNUSED int sig)
+{
+    _shutdown = 1;
+}
+
+
+/* only there to interrupt sigsuspend() */
+static void
+mnfcgi_prefork_chld(UNUSED int sig)
+{
+}
+
+
+static void
+mnfcgi_worker_pin(mnfcgi_config_t *config)
+{
+    int cpu;
+
+    if (config->ncpus == 0) {
+        return;
+    }
+    cpu = config->cpus[config->worker % config->ncpus];
+
+#if defined(__linux__)
+    {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+            CTRACE("sched_setaffinity cpu %d: %s", cpu, strerror(errno));
+        }
+    }
+#elif defined(__FreeBSD__)
+    {
+        cpuset_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (cpuset_setaffinity(CPU_LEVEL_WHICH,
+                               CPU_WHICH_PID,
+                               -1,
+                               sizeof(set),
+                               &set) != 0) {
+            CTRACE("cpuset_setaffinity cpu %d: %s", cpu, strerror(errno));
+        }
+    }
+#else
+    CTRACE("CPU pinning is not supported, ignoring cpu %d", cpu);
+#endif
+}
+
+
+/*
+ * Return zero in the child.
+ */
+static int
+mnfcgi_worker_start(mnfcgi_config_t *config,
+                    mnfcgi_worker_t *workers,
+                    int i)
+{
+    pid_t pid, ppid;
+
+    ppid = getpid();
+    if ((pid = fork()) == -1) {
+        CTRACE("fork: %s", strerror(errno));
+        return -1;
+    }
+
+    if (pid == 0) {
+        (void)sigaction(SIGTERM, &_osaterm, NULL);
+        (void)sigaction(SIGINT, &_osaint, NULL);
+        (void)sigaction(SIGCHLD, &_osachld, NULL);
+        (void)sigprocmask(SIG_SETMASK, &_osigmask, NULL);
+#if defined(__linux__)
+        /* do not outlive the supervisor */
+        (void)prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != ppid) {
+            /* it died before the above */
+            _exit(0);
+        }
+#endif
+        config->worker = i;
+        mnfcgi_worker_pin(config);
+        return 0;
+    }
+
+    workers[i].pid = pid;
+    workers[i].started = time(NULL);
+    return 1;
+}
+
+
+/*
+ * Fork config->nworkers worker processes, and restart those that crash.
+ * Must be called before mnthr_init().
+ *
+ * Returns zero in a worker, which then goes on to run mnfcgi_serve() as
+ * usual.  In the supervisor, returns a positive value after all workers
+ * have exited on SIGTERM or SIGINT, or an error code.  With no workers
+ * configured, returns zero right away.
+ */
+int
+mnfcgi_prefork(mnfcgi_config_t *config)
+{
+    int res;
+    mnfcgi_worker_t *workers;
+    struct sigaction sa;
+    sigset_t mask, waitmask;
+    int i, nrunning, rv;
+    bool killed;
+
+    if (config->nworkers <= 0) {
+        return 0;
+    }
+
+    if (config->family == PF_LOCAL) {
+        /* one socket, inherited by all workers */
+        if (config->fd == -1 &&
+            (config->fd = mnfcgi_listen(config, false)) == -1) {
+            return MNFCGI_PREFORK + 4;
+        }
+    } else {
+        config->reuseport = true;
+    }
+    if (MNUNLIKELY((workers = malloc(sizeof(mnfcgi_worker_t) *
+                                     config->nworkers)) == NULL)) {
+        FAIL("malloc");
+    }
+
+    /*
+     * The signals are blocked except in sigsuspend(), so that none of them
+     * arrives between checking _shutdown and going to sleep.
+     */
+    _shutdown = 0;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, &_osigmask) != 0) {
+        res = MNFCGI_PREFORK + 1;
+        goto end;
+    }
+    waitmask = _osigmask;
+    sigdelset(&waitmask, SIGTERM);
+    sigdelset(&waitmask, SIGINT);
+    sigdelset(&waitmask, SIGCHLD);
+
+    memset(&sa, '\0', sizeof(sa));
+    sa.sa_handler = mnfcgi_prefork_term;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGTERM, &sa, &_osaterm) != 0) {
+        (void)sigprocmask(SIG_SETMASK, &_osigmask, NULL);
+        res = MNFCGI_PREFORK + 1;
+        goto end;
+    }
+    if (sigaction(SIGINT, &sa, &_osaint) != 0) {
+        (void)sigaction(SIGTERM, &_osaterm, NULL);
+        (void)sigprocmask(SIG_SETMASK, &_osigmask, NULL);
+        res = MNFCGI_PREFORK + 1;
+        goto end;
+    }
+    sa.sa_handler = mnfcgi_prefork_chld;
+    if (sigaction(SIGCHLD, &sa, &_osachld) != 0) {
+        (void)sigaction(SIGTERM, &_osaterm, NULL);
+        (void)sigaction(SIGINT, &_osaint, NULL);
+        (void)sigprocmask(SIG_SETMASK, &_osigmask, NULL);
+        res = MNFCGI_PREFORK + 1;
+        goto end;
+    }
+
+    res = 1;
+    nrunning = 0;
+    killed = false;
+    for (i = 0; i < config->nworkers; ++i) {
+        workers[i].pid = -1;
+    }
+    for (i = 0; i < config->nworkers; ++i) {
+        if ((rv = mnfcgi_worker_start(config, workers, i)) == 0) {
+            res = 0;
+            goto end;
+        } else if (rv < 0) {
+            res = MNFCGI_PREFORK + 2;
+            _shutdown = 1;
+            break;
+        }
+        ++nrunning;
+    }
+
+    while (nrunning > 0) {
+        pid_t pid;
+        int status;
+
+        if (_shutdown && !killed) {
+            for (i = 0; i < config->nworkers; ++i) {
+                if (workers[i].pid != -1) {
+                    (void)kill(workers[i].pid, SIGTERM);
+                }
+            }
+            killed = true;
+        }
+
+        if ((pid = waitpid(-1, &status, WNOHANG)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            CTRACE("waitpid: %s", strerror(errno));
+            res = MNFCGI_PREFORK + 3;
+            break;
+        }
+        if (pid == 0) {
+            /* wait for SIGCHLD, SIGTERM or SIGINT */
+            (void)sigsuspend(&waitmask);
+            continue;
+        }
+
+        for (i = 0; i < config->nworkers; ++i) {
+            if (workers[i].pid == pid) {
+                break;
+            }
+        }
+        if (i == config->nworkers) {
+            continue;
+        }
+        workers[i].pid = -1;
+        --nrunning;
+
+        if (_shutdown ||
+            (WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+            continue;
+        }
+
+        CTRACE("worker %d (pid %d) %s %d, restarting",
+               i,
+               pid,
+               WIFSIGNALED(status) ? "killed by signal" : "exited with",
+               WIFSIGNALED(status) ?
+                    WTERMSIG(status) : WEXITSTATUS(status));
+        if (time(NULL) - workers[i].started < MNFCGI_WORKER_MIN_UPTIME) {
+            /* don't spin on a worker that cannot start */
+            (void)sleep(MNFCGI_WORKER_MIN_UPTIME);
+        }
+        if (_shutdown) {
+            continue;
+        }
+        if ((rv = mnfcgi_worker_start(config, workers, i)) == 0) {
+            res = 0;
+            goto end;
+        } else if (rv < 0) {
+            res = MNFCGI_PREFORK + 2;
+            _shutdown = 1;
+            continue;
+        }
+        ++nrunning;
+    }
+
+    (void)sigaction(SIGTERM, &_osaterm, NULL);
+    (void)sigaction(SIGINT, &_osaint, NULL);
+    (void)sigaction(SIGCHLD, &_osachld, NULL);
+    (void)sigprocmask(SIG_SETMASK, &_osigmask, NULL);
+
+end:
+    free(workers);
+    return res;
+}
+
+
+/*
+ * Multi-threaded mode.  Each OS thread runs an mnthr loop of its own, and
+ * accepts either on the listener shared by all threads, or on its own
+ * SO_REUSEPORT listener.
+ *
+ * None of the threads accepts before all of them have been created, so
+ * that a failure to create one can be backed out of.
+ */
+typedef struct _mnfcgi_pthread_gate {
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    int nready;
+    /* 1 to go ahead, -1 to give up */
+    int state;
+} mnfcgi_pthread_gate_t;
+
+typedef struct _mnfcgi_pthread {
+    mnfcgi_config_t *config;
+    mnfcgi_pthread_gate_t *gate;
+    pthread_t thread;
+    int res;
+} mnfcgi_pthread_t;
+
+
+static bool
+mnfcgi_pthread_gate_wait(mnfcgi_pthread_gate_t *gate)
+{
+    bool go;
+
+    (void)pthread_mutex_lock(&gate->mtx);
+    ++gate->nready;
+    (void)pthread_cond_broadcast(&gate->cond);
+    while (gate->state == 0) {
+        (void)pthread_cond_wait(&gate->cond, &gate->mtx);
+    }
+    go = gate->state > 0;
+    (void)pthread_mutex_unlock(&gate->mtx);
+    return go;
+}
+
+
+/*
+ * Wait until the n threads of pts are ready, and let them go unless one
+ * has failed already.
+ */
+static void
+mnfcgi_pthread_gate_open(mnfcgi_pthread_gate_t *gate,
+                         mnfcgi_pthread_t *pts,
+                         int n,
+                         bool go)
+{
+    int i;
+
+    (void)pthread_mutex_lock(&gate->mtx);
+    while (gate->nready < n) {
+        (void)pthread_cond_wait(&gate->cond, &gate->mtx);
+    }
+    for (i = 0; i < n; ++i) {
+        if (pts[i].res != 0) {
+            go = false;
+        }
+    }
+    gate->state = go ? 1 : -1;
+    (void)pthread_cond_broadcast(&gate->cond);
+    (void)pthread_mutex_unlock(&gate->mtx);
+}
+
+
+static int
+mnfcgi_pthread_serve(UNUSED int argc, void **argv)
+{
+    mnfcgi_pthread_t *pt;
+    int fd;
+
+    pt = argv[0];
+    if (pt->config->reuseport && pt->config->family != PF_LOCAL) {
+        if ((fd = mnfcgi_listen(pt->config, true)) == -1) {
+            pt->res = MNFCGI_RUN_PTHREADS + 1;
+            return 0;
+        }
+        pt->res = mnfcgi_serve_fd(pt->config, fd);
+        close(fd);
+    } else {
+        pt->res = mnfcgi_serve_fd(pt->config, pt->config->fd);
+    }
+    return 0;
+}
+
+
+static void *
+mnfcgi_pthread_main(void *arg)
+{
+    mnfcgi_pthread_t *pt;
+
+    pt = arg;
+    if (mnthr_init() != 0) {
+        pt->res = MNFCGI_RUN_PTHREADS + 4;
+        (void)mnfcgi_pthread_gate_wait(pt->gate);
+        return NULL;
+    }
+    if (mnfcgi_pthread_gate_wait(pt->gate)) {
+        (void)MNTHR_SPAWN("mnfcgi_serve", mnfcgi_pthread_serve, pt);
+        (void)mnthr_loop();
+    }
+    (void)mnthr_fini();
+    return NULL;
+}
+
+
+/*
+ * Serve with config->npthreads OS threads, and return when they all are
+ * done.  Called instead of running mnthr in the calling thread.
+ *
+ * More than one thread needs an mnthr that keeps its scheduler state per
+ * OS thread, otherwise the loops would share one.  This is asserted with
+ * ./configure --enable-pthreads, without it only one thread is allowed.
+ */
+int
+mnfcgi_run_pthreads(mnfcgi_config_t *config)
+{
+    int res;
+    mnfcgi_pthread_t *pts;
+    mnfcgi_pthread_gate_t gate;
+    bool shared;
+    int i, n;
+
+    if (config->npthreads <= 0) {
+        return MNFCGI_RUN_PTHREADS + 1;
+    }
+#ifndef MNFCGI_PTHREADS
+    if (config->npthreads > 1) {
+        CTRACE("%d threads need a build with --enable-pthreads",
+               config->npthreads);
+        return MNFCGI_RUN_PTHREADS + 5;
+    }
+#endif
+
+    shared = !config->reuseport || config->family == PF_LOCAL;
+    if (shared) {
+        if ((config->fd = mnfcgi_listen(config, false)) == -1) {
+            return MNFCGI_RUN_PTHREADS + 2;
+        }
+    }
+
+    if (MNUNLIKELY((pts = malloc(sizeof(mnfcgi_pthread_t) *
+                                 config->npthreads)) == NULL)) {
+        FAIL("malloc");
+    }
+    (void)pthread_mutex_init(&gate.mtx, NULL);
+    (void)pthread_cond_init(&gate.cond, NULL);
+    gate.nready = 0;
+    gate.state = 0;
+
+    res = 0;
+    for (n = 0; n < config->npthreads; ++n) {
+        int rv;
+
+        pts[n].config = config;
+        pts[n].gate = &gate;
+        pts[n].res = 0;
+        if ((rv = pthread_create(&pts[n].thread,
+                                 NULL,
+                                 mnfcgi_pthread_main,
+                                 &pts[n])) != 0) {
+            /* the error is returned, not set in errno */
+            CTRACE("pthread_create: %s", strerror(rv));
+            res = MNFCGI_RUN_PTHREADS + 3;
+            break;
+        }
+    }
+
+    /*
+     * Those that did start are let go only if all of them did, and have
+     * their own mnthr.
+     */
+    mnfcgi_pthread_gate_open(&gate, pts, n, res == 0);
+
+    for (i = 0; i < n; ++i) {
+        (void)pthread_join(pts[i].thread, NULL);
+        if (res == 0 && pts[i].res != 0) {
+            res = pts[i].res;
+        }
+    }
+
+    (void)pthread_cond_destroy(&gate.cond);
+    (void)pthread_mutex_destroy(&gate.mtx);
+    free(pts);
+    if (shared) {
+        close(config->fd);
+        config->fd = -1;
+    }
+    return res;
+}
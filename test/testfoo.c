@@ -1,9 +1,11 @@
 #include <assert.h>
+#include <string.h>
 
 #include <mncommon/bytes.h>
 #include <mncommon/hash.h>
 #include <mncommon/dumpm.h>
 
+#include "mnfcgi_private.h"
 #include <mnfcgi.h>
 #include <mnfcgi_app.h>
 #include "unittest.h"
@@ -76,6 +78,77 @@ test_mnhttp_parse_qterms(void)
 }
 
 
+size_t _mnfcgi_pct_decode(char *, const char *, size_t, bool);
+size_t _mnfcgi_kv_split(const char *, size_t, char, size_t, mnfcgi_kv_t *, size_t);
+mnfcgi_kv_t *_mnfcgi_kv_find(const char *, mnfcgi_kv_t *, size_t, const mnbytes_t *, bool);
+static void
+test_mnfcgi_kv(void)
+{
+    struct {
+        long rnd;
+        const char *in;
+        char sep;
+        size_t max;
+        size_t nkvs;
+        const char *key;
+        const char *value;
+    } data[] = {
+        {0, "a=1&b=2", '&', 16, 2, "b", "2"},
+        /* the first key wins */
+        {0, "a=1&a=2", '&', 16, 2, "a", "1"},
+        {0, "x+y=a+b", '&', 16, 1, "x y", "a b"},
+        {0, "%61%3D=%7e", '&', 16, 1, "a=", "~"},
+        /* malformed escapes are taken literally */
+        {0, "k=%41%4g%", '&', 16, 1, "k", "A%4g%"},
+        {0, "k=%2", '&', 16, 1, "k", "%2"},
+        {0, "=1&k&", '&', 16, 1, "k", ""},
+        {0, "=1", '&', 16, 0, "", NULL},
+        {0, "&&", '&', 16, 0, "a", NULL},
+        {0, "", '&', 16, 0, "a", NULL},
+        {0, "a=1&b=2&c=3", '&', 2, 2, "c", NULL},
+        {0, "a=1&b=2&c=3", '&', 2, 2, "b", "2"},
+        {0, "a=1; b=2;  c=%20", ';', 16, 3, "c", " "},
+        {0, "a=1; b=2;  c=3", ';', 16, 3, "b", "2"},
+        /* no '+' in cookies */
+        {0, "a=x+y", ';', 16, 1, "a", "x+y"},
+        {0, "a=1; b=2", ';', 16, 2, " b", NULL},
+    };
+    UNITTEST_PROLOG_RAND;
+
+    FOREACHDATA {
+        mnfcgi_kv_t kvs[16], *kv;
+        mnbytes_t *key;
+        size_t n;
+        bool plus;
+
+        plus = CDATA.sep == '&';
+        n = _mnfcgi_kv_split(CDATA.in,
+                             strlen(CDATA.in),
+                             CDATA.sep,
+                             0,
+                             kvs,
+                             CDATA.max);
+        assert(n == CDATA.nkvs);
+        key = bytes_new_from_str(CDATA.key);
+        kv = _mnfcgi_kv_find(CDATA.in, kvs, n, key, plus);
+        if (CDATA.value == NULL) {
+            assert(kv == NULL);
+        } else {
+            char buf[64];
+
+            assert(kv != NULL);
+            n = _mnfcgi_pct_decode(buf,
+                                   CDATA.in + kv->value,
+                                   kv->valuesz,
+                                   plus);
+            assert(n == strlen(CDATA.value));
+            assert(memcmp(buf, CDATA.value, n) == 0);
+        }
+        BYTES_DECREF(&key);
+    }
+}
+
+
 static void
 test0(void)
 {
@@ -161,18 +234,108 @@ test1(void)
             expected = NULL;
         }
         assert(bytes_cmp_safe(m, expected) == 0);
-        BYTES_DECREF(&m);
+        /* m is owned by the app */
         BYTES_DECREF(&expected);
     }
     mnfcgi_app_destroy(&app);
 }
 
 
+mnfcgi_app_endpoint_table_t *_mnfcgi_app_route_find(mnfcgi_app_t *app, const char *s, size_t sz);
+mnfcgi_app_endpoint_table_t *_mnfcgi_app_route_request(mnfcgi_app_t *app, mnfcgi_request_t *req);
+static void
+test2(void)
+{
+    mnfcgi_app_t *app;
+    BYTES_ALLOCA(__users, "/users");
+    BYTES_ALLOCA(__user, "/users/{id}");
+    BYTES_ALLOCA(__me, "/users/me");
+    BYTES_ALLOCA(__orders, "/users/{id}/orders");
+    BYTES_ALLOCA(__uploads, "/up/{path*}");
+    BYTES_ALLOCA(__static, "/static/*");
+    BYTES_ALLOCA(__bad0, "/users/{uid}/x");
+    BYTES_ALLOCA(__bad1, "/x/{a*}/y");
+    BYTES_ALLOCA(__up_a, "/up/a");
+    BYTES_ALLOCA(__b, "/b");
+    mnfcgi_request_t req;
+    mnfcgi_app_endpoint_table_t *e;
+    const char *v;
+    size_t sz;
+
+    mnfcgi_app_endpoint_table_t t[] = {
+        { __users, {myhandler, NULL,}, },
+        { __user, {myhandler, NULL,}, },
+        { __me, {myhandler, NULL,}, },
+        { __orders, {myhandler, NULL,}, },
+        { __uploads, {myhandler, NULL,}, },
+        { __static, {myhandler, NULL,}, },
+    };
+    mnfcgi_app_endpoint_table_t bad[] = {
+        { __bad0, {myhandler, NULL,}, },
+        { __bad1, {myhandler, NULL,}, },
+        { __users, {myhandler, NULL,}, },
+    };
+
+    struct {
+        long rnd;
+        const char *in;
+        mnbytes_t *out;
+    } data[] = {
+        {0, "/users", __users},
+        {0, "/users/", NULL},
+        {0, "/users/42", __user},
+        {0, "/users/me", __me},
+        {0, "/users/mex", __user},
+        {0, "/users/42/orders", __orders},
+        {0, "/users/42/orders/", NULL},
+        {0, "/up/a/b/c", __uploads},
+        {0, "/static/", __static},
+        {0, "/static/css/x.css", __static},
+        {0, "/stat", NULL},
+        {0, "", NULL},
+    };
+    UNITTEST_PROLOG_RAND;
+
+    app = mnfcgi_app_new("localhost", "1234", 1, 1, NULL);
+    assert(app != NULL);
+    for (i = 0; i < countof(t); ++i) {
+        assert(mnfcgi_app_register_endpoint(app, &t[i]) == 0);
+    }
+    for (i = 0; i < countof(bad); ++i) {
+        assert(mnfcgi_app_register_endpoint(app, &bad[i]) != 0);
+    }
+
+    FOREACHDATA {
+        e = _mnfcgi_app_route_find(app, CDATA.in, strlen(CDATA.in));
+        if (CDATA.out == NULL) {
+            assert(e == NULL);
+        } else {
+            assert(e != NULL && e->endpoint == CDATA.out);
+        }
+    }
+
+    /* a param that spans script_name and path_info, with no arena */
+    memset(&req, '\0', sizeof(req));
+    req.info.script_name = __up_a;
+    req.info.path_info = __b;
+    e = _mnfcgi_app_route_request(app, &req);
+    assert(e != NULL && e->endpoint == __uploads);
+    v = mnfcgi_app_get_route_param(&req, "path", &sz);
+    assert(v != NULL && sz == 3 && memcmp(v, "a/b", 3) == 0);
+    assert(mnfcgi_app_get_route_param(&req, "path", NULL) == v);
+    free(req.route_buf);
+
+    mnfcgi_app_destroy(&app);
+}
+
+
 int
 main(void)
 {
     test0();
     test_mnhttp_parse_qterms();
+    test_mnfcgi_kv();
     test1();
+    test2();
     return 0;
 }
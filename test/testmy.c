@@ -134,19 +134,16 @@ mystdout(mnfcgi_record_t *rec, mnbytestream_t *bs, void *udata)
             flags);
 
     } else if (flags == 2) {
-        mnhash_item_t *hit;
-        mnhash_iter_t it;
+        size_t i;
         ssize_t sz;
 
         sz = 0;
-        for (hit = hash_first(&req->headers, &it);
-             hit != NULL;
-             hit = hash_next(&req->headers, &it)) {
+        for (i = 0; i < req->nheaders; ++i) {
             mnbytes_t *name, *value;
             ssize_t n;
 
-            name = hit->key;
-            value = hit->value;
+            name = req->headers[i].name;
+            value = req->headers[i].value;
             n = BSZ(name) + BSZ(value) + 16;
             if (n < MNFCGI_MAX_PAYLOAD) {
                 sz += mnfcgi_printf(
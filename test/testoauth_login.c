@@ -103,7 +103,6 @@ testoauth_login_get(mnfcgi_request_t *req, UNUSED void *udata)
 
     } else {
         int res;
-        mnhash_item_t *hit;
         mnbytes_t *response_type;
         mnbytes_t *client_id;
         mnbytes_t *redirect_uri;
@@ -111,29 +110,22 @@ testoauth_login_get(mnfcgi_request_t *req, UNUSED void *udata)
         mnbytes_t *code;
         mnbytes_t *uri;
 
-        if ((hit = hash_get_item(
-                        &req->info.query_terms, &_response_type)) == NULL) {
+        if ((response_type = mnfcgi_request_get_query_term(
+                        req, &_response_type)) == NULL) {
             goto err403;
         }
-        response_type = hit->value;
 
-        if ((hit = hash_get_item(
-                        &req->info.query_terms, &_client_id)) == NULL) {
+        if ((client_id = mnfcgi_request_get_query_term(
+                        req, &_client_id)) == NULL) {
             goto err403;
         }
-        client_id = hit->value;
 
-        if ((hit = hash_get_item(
-                        &req->info.query_terms, &_redirect_uri)) == NULL) {
+        if ((redirect_uri = mnfcgi_request_get_query_term(
+                        req, &_redirect_uri)) == NULL) {
             goto err403;
         }
-        redirect_uri = hit->value;
 
-        if ((hit = hash_get_item(&req->info.query_terms, &_state)) != NULL) {
-            state = hit->value;
-        } else {
-            state = NULL;
-        }
+        state = mnfcgi_request_get_query_term(req, &_state);
 
         //CTRACE("authorization: %s", BDATA(authorization));
         //CTRACE("response_type=%s", BDATA(response_type));